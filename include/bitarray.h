@@ -3,6 +3,9 @@
 #include <string.h>
 #include <array>
 #include <atomic>
+#include <thread>
+#include <vector>
+#include <functional>
 #include "cpp-btree-1.0.1/btree_map.h"
 #include "log.h"
 
@@ -10,9 +13,40 @@ namespace moeingkv {
 
 // A very large vector of atomic pointers. Its internal memory is not continuous. Instead,
 // its uses multi-level tree structure. The ununsed parts (null pointers) are not allocated.
-// Its head part can be pruned.
+// Its head part can be pruned. The readers hold a 'pin_guard' while using the pointers they get,
+// and the pruned nodes are only freed after all the readers who pinned before they were unlinked
+// have left. The readers are counted in shards to avoid contending on one counter, and each
+// shard has two counters selected by the parity of 'epoch': the pruner flips the epoch and waits
+// for the old parity to drain, which the new readers do not join, so they cannot starve it.
 template<typename T>
 class large_atomic_ptr_vector {
+	enum {
+		READER_SHARDS = 64,
+	};
+	typedef std::vector<std::function<void()>> retired_list; // frees the unlinked nodes
+	struct alignas(64) reader_count {
+		std::atomic_long n[2];
+	};
+	mutable std::array<reader_count, READER_SHARDS> readers;
+	std::atomic_ullong epoch;
+	static int reader_shard() {
+		static std::atomic_int next_shard(0);
+		thread_local int shard = next_shard.fetch_add(1) % READER_SHARDS;
+		return shard;
+	}
+	// Wait until the readers pinned before now have left, after which the unlinked nodes are not
+	// in use. It takes two flips because a reader may have read the epoch long before it pins.
+	void wait_for_readers() {
+		for(int flip = 0; flip < 2; flip++) {
+			auto old_epoch = epoch.fetch_add(1);
+			for(auto& r : readers) {
+				while(r.n[old_epoch&1].load() != 0) {
+					std::this_thread::yield();
+				}
+			}
+		}
+	}
+
 	struct leaf_node {
 		std::array<std::atomic<T*>, 256> ptr_arr;
 		~leaf_node() {
@@ -26,11 +60,24 @@ class large_atomic_ptr_vector {
 		void set(int64_t i, T* new_ptr) {
 			return ptr_arr[i].store(new_ptr);
 		}
-		void prune_till(int64_t n) {
+		// the count of non-null pointers
+		int64_t count() const {
+			int64_t res = 0;
+			for(size_t i=0; i<ptr_arr.size(); i++) {
+				if(ptr_arr[i].load() != nullptr) res++;
+			}
+			return res;
+		}
+		// unlink the pointers before 'n' and return the count of non-null ones
+		int64_t prune_till(int64_t n, retired_list* retired) {
+			int64_t res = 0;
 			for(int64_t i=0; i<n; i++) {
 				auto ptr = ptr_arr[i].exchange(nullptr);
-				delete ptr;
+				if(ptr == nullptr) continue;
+				res++;
+				retired->push_back([ptr]() {delete ptr;});
 			}
+			return res;
 		}
 	};
 
@@ -56,19 +103,33 @@ class large_atomic_ptr_vector {
 		void set(int64_t i, T* new_ptr) {
 			auto ptr = ptr_arr[i>>shift()].load();
 			if(ptr == nullptr) {
-				ptr = new SUB;
+				ptr = new SUB(); // value-initialized to null pointers
 				ptr_arr[i>>shift()].store(ptr);
 			}
 			return ptr->set(i&mask(), new_ptr);
 		}
-		void prune_till(int64_t n) {
+		int64_t count() const {
+			int64_t res = 0;
+			for(size_t i=0; i<ptr_arr.size(); i++) {
+				auto ptr = ptr_arr[i].load();
+				if(ptr != nullptr) res += ptr->count();
+			}
+			return res;
+		}
+		int64_t prune_till(int64_t n, retired_list* retired) {
+			int64_t res = 0;
 			auto n_sh = n >> shift();
 			for(int64_t i=0; i < n_sh; i++) {
 				auto ptr = ptr_arr[i].exchange(nullptr);
-				delete ptr;
+				if(ptr == nullptr) continue;
+				res += ptr->count();
+				retired->push_back([ptr]() {delete ptr;});
 			}
 			auto ptr = ptr_arr[n_sh].load();
-			ptr->prune_till(n&mask());
+			if(ptr != nullptr) {
+				res += ptr->prune_till(n&mask(), retired);
+			}
+			return res;
 		}
 	};
 	typedef node<leaf_node, 1> mid1_node; //T* count: 2**16
@@ -76,19 +137,55 @@ class large_atomic_ptr_vector {
 	typedef node<mid2_node, 3> top_node; //T* count: 2**32
 public:
 	top_node top;
+	large_atomic_ptr_vector(): epoch(0), top() {
+		for(auto& r : readers) {
+			r.n[0].store(0);
+			r.n[1].store(0);
+		}
+	}
+	large_atomic_ptr_vector(const large_atomic_ptr_vector& other) = delete;
+	large_atomic_ptr_vector& operator=(const large_atomic_ptr_vector& other) = delete;
+	large_atomic_ptr_vector(large_atomic_ptr_vector&& other) = delete;
+	large_atomic_ptr_vector& operator=(large_atomic_ptr_vector&& other) = delete;
+
+	// While it lives, the pointers got from 'vec' are not freed by 'prune_till'
+	class pin_guard {
+		std::atomic_long* n;
+	public:
+		pin_guard(const large_atomic_ptr_vector* vec):
+		n(&vec->readers[reader_shard()].n[vec->epoch.load()&1]) {
+			n->fetch_add(1);
+		}
+		~pin_guard() {
+			n->fetch_sub(1);
+		}
+		pin_guard(const pin_guard& other) = delete;
+		pin_guard& operator=(const pin_guard& other) = delete;
+		pin_guard(pin_guard&& other) = delete;
+		pin_guard& operator=(pin_guard&& other) = delete;
+	};
 	T* get(int64_t i) const {
 		return top.get(i);
 	}
 	void set(int64_t i, T* new_ptr) {
 		top.set(i, new_ptr);
 	}
-	void prune_till(int64_t pos) {
-		top.prune_till(pos);
+	// Unlink the pointers before 'pos', and free them after the readers which may be using them
+	// have left. Returns the count of the freed non-null pointers. It must not be called concurrently.
+	int64_t prune_till(int64_t pos) {
+		retired_list retired;
+		int64_t res = top.prune_till(pos, &retired);
+		wait_for_readers();
+		for(auto& free_node : retired) {
+			free_node();
+		}
+		return res;
 	}
 };
 
 // A virtually 2**54-entry bitarray. Its beginning part can be pruned. 
-// The default value for the bits is 0.
+// The default value for the bits is 0, while the pruned bits are all taken as 1, because the
+// pruned ids are the ones no longer used by any kv pair.
 class bitarray: public ds_with_log {
 	enum {
 		LEAF_BITS = 24, // 16 million bits, 2MByte
@@ -105,27 +202,34 @@ class bitarray: public ds_with_log {
 		return a;
 	}
 
+	typedef large_atomic_ptr_vector<arr_t>::pin_guard pin_guard;
 	large_atomic_ptr_vector<arr_t> vec_of_arr; 
+	std::atomic_llong pruned_pos; // the bits before it are pruned
+	std::atomic_llong arr_count; // how many arr_t are allocated
 
 public:
-	bitarray(): vec_of_arr() {}
+	bitarray(): vec_of_arr(), pruned_pos(0), arr_count(0) {}
 	bitarray(const bitarray& other) = delete;
 	bitarray& operator=(const bitarray& other) = delete;
 	bitarray(bitarray&& other) = delete;
 	bitarray& operator=(bitarray&& other) = delete;
 
 	bool get(int64_t pos) const {
+		pin_guard guard(&vec_of_arr);
 		auto arr_ptr = vec_of_arr.get(pos>>LEAF_BITS);
-		if(arr_ptr == nullptr) return false;
+		if(arr_ptr == nullptr) return pos < pruned_pos.load(); // 'pruned_pos' is raised before unlinking
 		selector64 sel(pos&LEAF_MASK);
 		return (arr_ptr->at(sel.n).load() & sel.mask) != 0;
 	}
 private:
 	void modify(int64_t pos, bool set, bool clear) {
+		pin_guard guard(&vec_of_arr);
+		if(pos < pruned_pos.load()) return;
 		auto arr_ptr = vec_of_arr.get(pos>>LEAF_BITS);
 		if(arr_ptr == nullptr) {
 			arr_ptr = get_empty_arr();
 			vec_of_arr.set(pos>>LEAF_BITS, arr_ptr);
+			arr_count.fetch_add(1);
 		}
 		selector64 sel(pos&LEAF_MASK);
 		if(set) {
@@ -152,39 +256,70 @@ public:
 		log_i64(RW_VAULT_LOG_SIZE_TAG);
 		log_i64(size);
 	}
+	// Prune the bits before 'pos', whose ids must be no longer used by any kv pair. It blocks until
+	// the concurrent readers of the pruned memory have left.
 	void prune_till(int64_t pos) {
-		vec_of_arr.prune_till(pos>>LEAF_BITS);
+		if(pos <= pruned_pos.load()) return;
+		pruned_pos.store(pos);
+		arr_count.fetch_sub(vec_of_arr.prune_till(pos>>LEAF_BITS));
+	}
+	int64_t get_pruned_pos() const {
+		return pruned_pos.load();
+	}
+	// the memory used by the bits
+	uint64_t memory_bytes() const {
+		return arr_count.load() * sizeof(arr_t);
 	}
+	// Replay the log files in 'file_list'. A torn frame at the end of a file is cut off.
 	bool load_data_from_logs(const std::vector<int>& file_list, int64_t* rw_vault_log_size) {
 		for(int i=0; i<file_list.size(); i++) {
 			std::string fname = log_dir+"/"+std::to_string(file_list[i]);
-			std::ifstream fin;
-			fin.open(fname.c_str(), std::ios::in | std::ios::binary);
-			if(!fin.is_open()) {
-				std::cerr<<"Failed to open file "<<fname<<std::endl;
+			mapped_file content;
+			std::vector<log_frame> frames;
+			if(!read_log_frames(fname, &content, &frames, true)) {
 				return false;
 			}
-			int64_t i64;
-			for(;;) {
-				auto state = read_i64(fin, &i64);
-				if((state & std::ios::eofbit ) != 0) {
-					break;
+			for(auto& frame : frames) {
+				if(frame.encoding != LOG_ENCODING_RAW) {
+					std::cerr<<"Unknown log encoding in file "<<fname<<std::endl;
+					return false;
 				}
-				if((state & std::ios::failbit ) != 0) {
-					std::cerr<<"Failed to read file "<<fname<<std::endl;
+				if(!load_frame(frame, fname, rw_vault_log_size)) {
 					return false;
 				}
-				if(i64 == RW_VAULT_LOG_SIZE_TAG) {
-					state = read_i64(fin, rw_vault_log_size);
-					if((state & std::ios::failbit ) != 0) {
-						std::cerr<<"Failed to read file "<<fname<<std::endl;
-						return false;
-					}
-				} else if(i64 > 0) { // positive for set
-					set(i64);
-				} else { //negative for clear
-					clear(-i64);
+			}
+		}
+		return true;
+	}
+private:
+	// a raw entry is an i64, and RW_VAULT_LOG_SIZE_TAG is followed by another i64
+	size_t raw_entries_size(const char* data, size_t size) {
+		log_reader reader(data, size);
+		size_t whole = 0;
+		int64_t i64;
+		while(reader.read_i64(&i64)) {
+			if(i64 == RW_VAULT_LOG_SIZE_TAG && !reader.read_i64(&i64)) break;
+			whole = size - reader.left();
+		}
+		return whole;
+	}
+	bool load_frame(const log_frame& frame, const std::string& fname, int64_t* rw_vault_log_size) {
+		log_reader reader(frame.data, frame.size);
+		int64_t i64;
+		while(!reader.at_end()) {
+			if(!reader.read_i64(&i64)) {
+				std::cerr<<"Failed to read file "<<fname<<std::endl;
+				return false;
+			}
+			if(i64 == RW_VAULT_LOG_SIZE_TAG) {
+				if(!reader.read_i64(rw_vault_log_size)) {
+					std::cerr<<"Failed to read file "<<fname<<std::endl;
+					return false;
 				}
+			} else if(i64 > 0) { // positive for set
+				set(i64);
+			} else { //negative for clear
+				clear(-i64);
 			}
 		}
 		return true;
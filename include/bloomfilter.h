@@ -18,6 +18,11 @@ class bitslice {
 	std::atomic_ullong d[N];
 	static_assert(VAULT_COUNT==64 || VAULT_COUNT==128 || VAULT_COUNT==256 || VAULT_COUNT==512, "invalid size");
 public:
+	bitslice() {
+		for(int i=0; i<N; i++) {
+			d[i].store(0);
+		}
+	}
 
 	bitslice& operator|=(const bitslice& other) {
 		for(int i=0; i<N; i++) {
@@ -68,6 +73,22 @@ public:
 		selector64 sel(pos);
 		return (_data[sel.n] & sel.mask) != 0;
 	}
+	// the bits are saved and restored as _size/64 words
+	size_t word_count() const {
+		return _size/64;
+	}
+	uint64_t get_word(size_t i) const {
+		return _data[i];
+	}
+	// Fill the bits with the words of another bloomfilter whose size divides this one's. The
+	// words are repeated, like what 'bloomfilter256::double_sized' does, so 'h%_size' of a key
+	// hits the same bit as 'h%(other size)' did.
+	void fill_words(const std::vector<uint64_t>& words) {
+		assert(!words.empty() && word_count() % words.size() == 0);
+		for(size_t i=0; i<word_count(); i++) {
+			_data[i] = words[i % words.size()];
+		}
+	}
 };
 
 // 256 bloomfilters of the same size. It has the same functionality of 256 bloomfilters while its
@@ -0,0 +1,198 @@
+#pragma once
+#include <vector>
+#include "log.h"
+
+namespace moeingkv {
+
+// Which compaction a checkpoint belongs to. A checkpoint is only resumed by the same compaction,
+// on the same input.
+struct checkpoint_header {
+	int64_t new_vault; // the number of the new disk vault
+	int64_t first_old_vault; // the number of the oldest merged disk vault
+	int64_t old_vault_count;
+	int64_t old_vault_pages; // the total pages of the merged disk vaults
+	int64_t ro_entries; // the size of ro_vault
+	int64_t ro_log_size; // the size of ro_vault's log file, from which ro_vault is loaded
+};
+
+// the durable result of one compacted row
+struct row_checkpoint {
+	int                   row;
+	int64_t               end_offset; // the size of new vault after this row is appended
+	int64_t               min_id; // the smallest id in the pages of this row
+	std::vector<uint64_t> index; // the first keys of the pages of this row
+	std::vector<uint64_t> bloom_words; // the bloomfilter of this row in new vault
+	std::vector<kv_pair>  spilled; // the pairs of this row which went into wo_vault
+};
+
+// The progress of a running compaction, kept in a log file named after the new vault. The first
+// frame is the header, and then one frame is appended for each row appended to new vault. The
+// rows are appended in groups, after the vault file is synced, so the rows in the checkpoint are
+// always on disk, and after a crash the compaction resumes from the row after the last one in it.
+class compaction_checkpoint : public ds_with_log {
+	enum {
+		TAG_HEADER = 1,
+		TAG_ROW = 2,
+	};
+	static bool read_header(log_reader* reader, checkpoint_header* h) {
+		return reader->read_i64(&h->new_vault) && reader->read_i64(&h->first_old_vault) &&
+			reader->read_i64(&h->old_vault_count) && reader->read_i64(&h->old_vault_pages) &&
+			reader->read_i64(&h->ro_entries) && reader->read_i64(&h->ro_log_size);
+	}
+	static bool read_row(log_reader* reader, row_checkpoint* rc) {
+		uint32_t row;
+		uint64_t count;
+		if(!reader->read_u32(&row) || !reader->read_i64(&rc->end_offset) ||
+		   !reader->read_i64(&rc->min_id) || !reader->read_u64(&count)) {
+			return false;
+		}
+		rc->row = row;
+		rc->index.resize(count);
+		for(auto& key : rc->index) {
+			if(!reader->read_u64(&key)) return false;
+		}
+		if(!reader->read_u64(&count)) return false;
+		rc->bloom_words.resize(count);
+		for(auto& word : rc->bloom_words) {
+			if(!reader->read_u64(&word)) return false;
+		}
+		if(!reader->read_u64(&count)) return false;
+		rc->spilled.resize(count);
+		for(auto& kv : rc->spilled) {
+			if(!reader->read_u64(&kv.key) || !reader->read_i64(&kv.id) ||
+			   !reader->read_str(&kv.value.kstr) || !reader->read_str(&kv.value.vstr)) {
+				return false;
+			}
+		}
+		return true;
+	}
+	static bool read_rows(const std::string& fname, const checkpoint_header& h,
+	                      std::vector<row_checkpoint>* rows) {
+		rows->clear();
+		mapped_file content;
+		std::vector<log_frame> frames;
+		if(!read_log_file(fname, &content, &frames, true) || frames.empty()) {
+			return false;
+		}
+		for(size_t i=0; i<frames.size(); i++) {
+			if(frames[i].encoding != LOG_ENCODING_RAW) {
+				std::cerr<<"Unknown log encoding in file "<<fname<<std::endl;
+				return false;
+			}
+			log_reader reader(frames[i].data, frames[i].size);
+			int64_t tag;
+			if(!reader.read_i64(&tag)) {
+				std::cerr<<"Failed to read file "<<fname<<std::endl;
+				return false;
+			}
+			if(i == 0) {
+				checkpoint_header fh;
+				if(tag != TAG_HEADER || !read_header(&reader, &fh)) {
+					std::cerr<<"Failed to read file "<<fname<<std::endl;
+					return false;
+				}
+				if(fh.new_vault != h.new_vault || fh.first_old_vault != h.first_old_vault ||
+				   fh.old_vault_count != h.old_vault_count || fh.old_vault_pages != h.old_vault_pages ||
+				   fh.ro_entries != h.ro_entries || fh.ro_log_size != h.ro_log_size) {
+					return false; // the input of the compaction has changed
+				}
+				continue;
+			}
+			row_checkpoint rc;
+			if(tag != TAG_ROW || !read_row(&reader, &rc) || rc.row != int(rows->size())) {
+				std::cerr<<"Failed to read file "<<fname<<std::endl;
+				return false;
+			}
+			rows->push_back(std::move(rc));
+		}
+		return true;
+	}
+public:
+	compaction_checkpoint() {}
+	compaction_checkpoint(const compaction_checkpoint& other) = delete;
+	compaction_checkpoint& operator=(const compaction_checkpoint& other) = delete;
+	compaction_checkpoint(compaction_checkpoint&& other) = delete;
+	compaction_checkpoint& operator=(compaction_checkpoint&& other) = delete;
+
+	// Read the checkpoint file 'num' into 'rows', which are the rows 0, 1, 2 ... in order. A torn
+	// frame at its end is cut off. Returns false if the file is missing or unreadable, or it
+	// belongs to another compaction than 'h', and then the file is deleted.
+	bool load(int num, const checkpoint_header& h, std::vector<row_checkpoint>* rows) {
+		std::string fname = log_dir+"/"+std::to_string(num);
+		if(access(fname.c_str(), F_OK) != 0) {
+			return false;
+		}
+		if(!read_rows(fname, h, rows)) {
+			rows->clear();
+			remove_file(fname);
+			return false;
+		}
+		return true;
+	}
+	// Start writing the checkpoint file 'num'. If 'resume' is true, the loaded file is continued.
+	// Otherwise the old content and the checkpoints of other compactions, which can never be
+	// resumed, are discarded, and the header 'h' is written.
+	bool open(int num, const checkpoint_header& h, bool resume) {
+		if(log_fd >= 0) {
+			close(log_fd);
+			log_fd = -1;
+		}
+		log_buf.clear();
+		curr_log_fname = log_dir+"/"+std::to_string(num);
+		if(!resume) {
+			std::vector<int> file_list;
+			get_log_nums(log_dir, &file_list);
+			for(auto other : file_list) {
+				if(other != num) remove_file(log_dir+"/"+std::to_string(other));
+			}
+		}
+		if(!open_log_file(resume ? 0 : O_TRUNC)) {
+			return false;
+		}
+		if(resume) return true;
+		log_i64(TAG_HEADER);
+		log_i64(h.new_vault);
+		log_i64(h.first_old_vault);
+		log_i64(h.old_vault_count);
+		log_i64(h.old_vault_pages);
+		log_i64(h.ro_entries);
+		log_i64(h.ro_log_size);
+		return flush_log();
+	}
+	bool is_open() const {
+		return log_fd >= 0;
+	}
+	// Append a row as one frame. It is durable after 'sync_log'.
+	bool append_row(const row_checkpoint& rc) {
+		log_i64(TAG_ROW);
+		log_u32(rc.row);
+		log_i64(rc.end_offset);
+		log_i64(rc.min_id);
+		log_u64(rc.index.size());
+		for(auto key : rc.index) {
+			log_u64(key);
+		}
+		log_u64(rc.bloom_words.size());
+		for(auto word : rc.bloom_words) {
+			log_u64(word);
+		}
+		log_u64(rc.spilled.size());
+		for(auto& kv : rc.spilled) {
+			log_u64(kv.key);
+			log_i64(kv.id);
+			log_str(kv.value.kstr);
+			log_str(kv.value.vstr);
+		}
+		return flush_log();
+	}
+	// Close and delete the checkpoint file, once its compaction is finished and switched in
+	void discard() {
+		if(log_fd < 0) return;
+		close(log_fd);
+		log_fd = -1;
+		log_buf.clear();
+		remove_log();
+	}
+};
+
+}
@@ -20,7 +20,9 @@ enum __const_t {
 #define MEM_VAULT_LOG_DIR ("mvault")
 #define DISK_VAULT_DIR ("vault")
 #define DEL_LOG_DIR ("del")
+#define CHECKPOINT_DIR ("ckpt")
 #define META_FILE ("meta.txt")
+#define HOT_KEYS_FILE ("hotkeys")
 
 // select a bit in u64 vector&array
 struct selector64 {
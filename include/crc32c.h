@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+namespace moeingkv {
+
+// CRC32C (Castagnoli) checksum, used to check the integrity of log frames. The SSE4.2 crc32
+// instructions are used when the compiler targets them, otherwise a lookup table is used.
+class crc32c {
+	struct table {
+		uint32_t t[256];
+		table() {
+			for(uint32_t i = 0; i < 256; i++) {
+				uint32_t c = i;
+				for(int k = 0; k < 8; k++) {
+					c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+				}
+				t[i] = c;
+			}
+		}
+	};
+public:
+	// Continue calculating the checksum from 'crc' (whose initial value is 0) with more data
+	static uint32_t extend(uint32_t crc, const char* data, size_t size) {
+		crc = ~crc;
+#if defined(__SSE4_2__)
+		uint64_t c64 = crc;
+		for(; size >= 8; size -= 8, data += 8) {
+			uint64_t u64;
+			memcpy(&u64, data, 8);
+			c64 = _mm_crc32_u64(c64, u64);
+		}
+		crc = uint32_t(c64);
+		for(; size > 0; size--, data++) {
+			crc = _mm_crc32_u8(crc, uint8_t(*data));
+		}
+#else
+		static const table tab;
+		for(; size > 0; size--, data++) {
+			crc = tab.t[(crc ^ uint8_t(*data)) & 0xFF] ^ (crc >> 8);
+		}
+#endif
+		return ~crc;
+	}
+	static uint32_t value(const char* data, size_t size) {
+		return extend(0, data, size);
+	}
+};
+
+}
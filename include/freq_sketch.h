@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+namespace moeingkv {
+
+// A count-min sketch which estimates how many times a key was accessed recently. It is the
+// frequency part of TinyLFU. The counters saturate at MAX_COUNT, and after 'sample_size'
+// increments all the counters are halved, such that the old popularity fades out.
+// It is not thread-safe, the caller must serialize the accesses.
+class freq_sketch {
+	enum {
+		DEPTH = 4,
+		MAX_COUNT = 15,
+		SAMPLE_FACTOR = 10, // halve the counters after SAMPLE_FACTOR*width increments
+	};
+	std::vector<uint8_t> counters; // DEPTH rows, each of which has 'width' counters
+	size_t width;
+	size_t additions;
+	size_t sample_size;
+
+	// 'key' is already a hash value, so a multiply-shift is enough to get independent positions
+	size_t index_of(uint64_t key, int i) const {
+		static const uint64_t MULTIPLIER[DEPTH] = {
+			0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+			0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL,
+		};
+		uint64_t h = (key ^ (key >> 31)) * MULTIPLIER[i];
+		return i * width + (h >> 32) % width;
+	}
+	void age() {
+		for(size_t i = 0; i < counters.size(); i++) {
+			counters[i] >>= 1;
+		}
+		additions /= 2;
+	}
+public:
+	freq_sketch(): counters(), width(0), additions(0), sample_size(0) {}
+	freq_sketch(const freq_sketch& other) = delete;
+	freq_sketch& operator=(const freq_sketch& other) = delete;
+	freq_sketch(freq_sketch&& other) = delete;
+	freq_sketch& operator=(freq_sketch&& other) = delete;
+
+	// re-allocate the counters for about 'w' distinct keys, the history is discarded
+	void resize(size_t w) {
+		width = w < 16 ? 16 : w;
+		counters.assign(DEPTH * width, 0);
+		additions = 0;
+		sample_size = SAMPLE_FACTOR * width;
+	}
+	// record one access of 'key'
+	void increment(uint64_t key) {
+		if(width == 0) return;
+		bool added = false;
+		for(int i = 0; i < DEPTH; i++) {
+			auto idx = index_of(key, i);
+			if(counters[idx] < MAX_COUNT) {
+				counters[idx]++;
+				added = true;
+			}
+		}
+		if(added && ++additions >= sample_size) {
+			age();
+		}
+	}
+	// the estimated access count of 'key', which may be larger but never smaller than the real one
+	int estimate(uint64_t key) const {
+		if(width == 0) return 0;
+		int res = MAX_COUNT;
+		for(int i = 0; i < DEPTH; i++) {
+			int c = counters[index_of(key, i)];
+			if(c < res) res = c;
+		}
+		return res;
+	}
+};
+
+}
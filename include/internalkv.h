@@ -1,95 +1,505 @@
 #pragma once
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <map>
+#include <memory>
 #include <fcntl.h>
 #include "u64vec.h"
 #include "ptr_for_rent.h"
 #include "vault_in_mem.h"
 #include "sharded_cache.h"
+#include "thread_pool.h"
+#include "checkpoint.h"
 #include "cpp-btree-1.0.1/btree_set.h"
 
 namespace moeingkv {
 
 typedef std::array<ptr_for_rent<bloomfilter256>, ROW_COUNT> bf256arr_t;
+typedef btree::btree_multimap<uint64_t, dstr_with_id> batch_map;
+
+// what a caller of 'internalkv::commit' gets after its batch is written
+struct commit_result {
+	int64_t seq; // the write sequence number of the group commit, which can be waited by 'wait_durable'
+	int     group_size; // how many batches were merged into this group commit
+};
+
+// when the scheduler of compaction switches the vaults and starts a new compaction
+struct compaction_policy {
+	size_t  rw_vault_entries; // when rw_vault has so many entries
+	size_t  mem_vault_entries; // or when rw_vault and ro_vault have so many entries together, 0 for no limit
+	int64_t max_vault_age_ms; // or when the oldest disk vault is so old, 0 for no limit
+	int     threads; // how many threads compact the rows in parallel
+	int     max_disk_vaults; // merge several oldest disk vaults into one until at most so many are live, 0 for no limit
+};
+
+// the counters of compacting one row
+struct compaction_row_stats {
+	int64_t  duration_us;
+	uint64_t pages_in; // the pages read from the old vaults
+	uint64_t pages_out; // the pages written to new vault
+	uint64_t copied_pages; // the pages copied without being decoded, counted in both of the above
+	uint64_t spilled_pairs; // the pairs which cannot be packed and go into wo_vault
+	uint64_t dropped_pairs; // the deleted pairs which are dropped
+	uint64_t bloom_resizes; // how many times the bloomfilter is doubled
+};
+
+// A snapshot of the progress of the running compaction (or the last one if none is running), and
+// how the vault switches affect the write path
+struct compaction_stats {
+	int64_t  seq; // how many compactions have been started
+	bool     running;
+	int      merged_vaults; // how many old disk vaults are merged
+	uint64_t mem_bytes; // the packed size of ro_vault, pages_out*PAGE_SIZE/mem_bytes is the write amplification
+	int      rows_started;
+	int      rows_done;
+	int      rows_resumed; // the rows restored from the checkpoint of a compaction interrupted by a crash
+	bool     failed; // the vault I/O failed, so the vaults are not switched any more
+	int64_t  duration_us; // till now if it is running
+	compaction_row_stats              total; // its duration_us is the sum of all the rows'
+	std::vector<compaction_row_stats> rows;
+	uint64_t switch_count;
+	int64_t  switch_us; // the total time spent by the writers on switching vaults
+	uint64_t max_rw_entries; // the largest rw_vault at a switch, which is larger than the policy if compaction lags
+	int64_t  del_mark_pruned_pos; // the ids before it are no longer used and pruned from del_mark
+	uint64_t del_mark_bytes; // the memory used by del_mark
+};
+
+// one key to be looked up in a batch
+struct lookup_req {
+	uint64_t    key;
+	std::string kstr;
+	str_with_id out;
+	bool        found;
+};
 
 class compactor {
 	friend class internalkv;
+	enum {
+		CHECKPOINT_ROWS = 16, // new vault is synced and the checkpoint is appended once per so many rows
+	};
 	vault_in_mem*    wo_vault; // a write-only vault
 	vault_in_mem*    ro_vault; // a read-only vault
-	u64vec*          old_vault_index;
-	int              old_vault_fd;
+	// the oldest disk vaults to be merged, from old to young
+	struct old_vault {
+		u64vec* index;
+		int     fd;
+	};
+	std::vector<old_vault> old_vaults;
 	u64vec*          new_vault_index;
 	int              new_vault_fd;
+	int64_t          new_vault_min_id; // the smallest id written to new vault
 	uint8_t          new_vault_lsb;
 	bitarray*        del_mark;
 	seeds*           seeds_for_bloom;
 	bf256arr_t*      bf256arr;
+	thread_pool*     workers; // compacts the rows in parallel, or null for compacting one by one
+	rate_limiter*    limiter; // throttles the reads and writes
 	std::atomic_bool done;
-	// check the size of the bloomfilter at 'row', if it is too small, replaced it with a double-sized one
-	size_t check_bloomfilter_size(int row) {
-		size_t size;
-		bloomfilter256* bf = nullptr; // a 2x enlarged bloomfilter
-		bf256arr->at(row).rent_const([&size, &bf, this, row](const bloomfilter256* curr_bf) {
-			size = curr_bf->size();
-			if(size < 2 * BITS_PER_ENTRY * this->ro_vault->size_at_row(row)) {
-				bf = curr_bf->double_sized();
-				size *= 2;
-			}
-		});
-		if(bf != nullptr) {
+	std::atomic_bool failed; // reading old vaults or writing new vault failed, so it must not be switched in
+	std::mutex       stats_mtx; // protects the following members
+	compaction_stats stats;
+	std::chrono::steady_clock::time_point start_time;
+	std::ofstream    event_log; // a line is appended for each row and each compaction if it is open
+	compaction_checkpoint checkpoint; // the rows appended to new vault
+	std::vector<row_checkpoint> unsynced_rows; // appended to new vault but not to the checkpoint yet
+	int              resumed_rows; // the rows before it are restored from the checkpoint
+	// the pages and their first keys of one compacted row
+	struct row_output {
+		std::string           pages;
+		u64vec                index;
+		int64_t               min_id;
+		std::vector<uint64_t> bloom_words; // the row's bloomfilter of new vault
+		std::vector<kv_pair>  spilled; // the pairs put into wo_vault
+	};
+	// Check the size of the bloomfilter at 'row', if it is too small for the pairs of ro_vault and
+	// 'extra_pairs' more, replace it with a double-sized one. 'resizes' counts the replacements.
+	size_t check_bloomfilter_size(int row, size_t extra_pairs, uint64_t* resizes) {
+		for(;; (*resizes)++) {
+			size_t size;
+			bloomfilter256* bf = nullptr; // a 2x enlarged bloomfilter
+			bf256arr->at(row).rent_const([&size, &bf, this, row, extra_pairs](const bloomfilter256* curr_bf) {
+				size = curr_bf->size();
+				if(size < 2 * BITS_PER_ENTRY * (this->ro_vault->size_at_row(row) + extra_pairs)) {
+					bf = curr_bf->double_sized();
+				}
+			});
+			if(bf == nullptr) return size;
 			bf256arr->at(row).replace(bf);
 		}
-		return size;
 	}
-	// compact one row of old vault and one row of ro_vault into one row of new vault.
-	// some entries which cannot be compacted, will be inserted to wo_vault. 
-	void compact_row(int row) {
-		size_t bloom_size = check_bloomfilter_size(row);
-		bloomfilter new_bf(bloom_size, seeds_for_bloom);
-		ssize_t start = old_vault_index->search(row_to_key(row)) * PAGE_SIZE;
-		if(start < 0) return;
-		ssize_t end = old_vault_index->search(row_to_key(row+1)) * PAGE_SIZE;
-		assert(end >= 1);
-		kv_reader reader(start, end, old_vault_fd, del_mark);
+	// the first page in an old vault whose first key is not smaller than 'key'
+	static ssize_t first_page_from(u64vec* index, uint64_t key) {
+		ssize_t pageid = index->search(key);
+		if(pageid < 0) return 0;
+		return index->get(pageid) == key ? pageid : pageid + 1;
+	}
+	// Copy the clean page of an old vault to 'out' as a whole if no pair of the other producers of
+	// 'merger' falls in its key range and it does not continue the same-key group packed last.
+	// Returns whether it is copied.
+	bool copy_clean_page(page* pg, multi_merged_kv_producer* merger, bloomfilter* new_bf,
+			kv_packer* packer, row_output* out, uint64_t* last_key, bool* has_last_key) {
+		size_t count = pg->pair_count();
+		uint64_t first = pg->key_at(0);
+		uint64_t last = pg->key_at(count-1);
+		if((*has_last_key && first <= *last_key) || !merger->others_after(last)) {
+			return false;
+		}
+		packer->flush();
+		out->pages.append(pg->data(), PAGE_SIZE);
+		out->index.append(first);
+		for(size_t i=0; i<count; i++) {
+			new_bf->add(pg->key_at(i));
+		}
+		*last_key = last;
+		*has_last_key = true;
+		out->min_id = std::min(out->min_id, pg->min_id());
+		return true;
+	}
+	// compact one row of the old vaults and one row of ro_vault into the pages in 'out'.
+	// some entries which cannot be compacted, will be inserted to wo_vault. If an old vault cannot
+	// be read, 'failed' is set and 'out' is incomplete.
+	void compact_row(int row, row_output* out) {
+		auto start_time = std::chrono::steady_clock::now();
+		compaction_row_stats rs{};
+		{
+			std::lock_guard<std::mutex> lk(stats_mtx);
+			stats.rows_started++;
+		}
+		std::vector<std::unique_ptr<kv_reader>> readers;
+		std::vector<kv_producer*> prods;
+		size_t extra_pages = 0; // the pages of the old vaults except the oldest one
+		for(size_t i=0; i<old_vaults.size(); i++) {
+			auto index = old_vaults[i].index;
+			ssize_t start = first_page_from(index, row_to_key(row));
+			ssize_t end = row+1 == ROW_COUNT ? index->size() : first_page_from(index, row_to_key(row+1));
+			if(i != 0) extra_pages += end - start;
+			readers.emplace_back(new kv_reader(start * PAGE_SIZE, end * PAGE_SIZE, old_vaults[i].fd,
+				del_mark, limiter));
+			prods.push_back(readers.back().get());
+		}
 		auto prod = ro_vault->get_kv_producer(row, del_mark);
-		merged_kv_producer merger(&reader, &prod);
-		kv_packer packer(new_vault_fd, &new_bf, new_vault_index);
+		prods.push_back(&prod);
+		multi_merged_kv_producer merger(prods);
+		// the bloomfilter is sized for one vault, so the pairs of the other merged vaults are
+		// estimated with the average pair size of ro_vault
+		size_t pair_size = ro_vault->size() == 0 ? 64 : ro_vault->packed_bytes() / ro_vault->size();
+		size_t extra_pairs = extra_pages * PAGE_SIZE / std::max(pair_size, size_t(1));
+		size_t bloom_size = check_bloomfilter_size(row, extra_pairs, &rs.bloom_resizes);
+		bloomfilter new_bf(bloom_size, seeds_for_bloom);
+		kv_packer packer(&out->pages, &new_bf, &out->index);
 		int64_t packed_num = 0;
 		bool bloom_is_full = false;
+		uint64_t last_key = 0; // the key of the last pair in new pages
+		bool has_last_key = false;
+		std::vector<kv_pair> group; // the pairs with the same key, which cannot span two pages
 		while(merger.valid()) {
-			auto kv = merger.produce();
-			if(bloom_is_full) {// bloomfilter is full, so new entries go into wo_vault
-				wo_vault->add(kv.key, dstr_with_id{.dstr=kv.value, .id=kv.id});
+			int top = merger.top();
+			// untouched pages are copied without being decoded
+			auto pg = top < int(readers.size()) ? readers[top]->clean_page() : nullptr;
+			if(pg != nullptr && !bloom_is_full &&
+			   bloom_size >= BITS_PER_ENTRY * (packed_num + pg->pair_count()) &&
+			   copy_clean_page(pg, &merger, &new_bf, &packer, out, &last_key, &has_last_key)) {
+				packed_num += pg->pair_count();
+				rs.copied_pages++;
+				readers[top]->skip_page();
+				merger.update_top();
 				continue;
 			}
-			if(!packer.can_consume(kv)) { //enough kv pairs for one page
+			group.clear();
+			group.push_back(merger.produce());
+			while(merger.valid() && merger.peek_key() == group[0].key) {
+				group.push_back(merger.produce());
+			}
+			if(!bloom_is_full && !packer.can_consume_all(group)) { //enough kv pairs for one page
 				packer.flush(); //flush the kv pairs to disk
-				while(merger.in_middle_of_same_key()) {// same key cannot span two pages
+			}
+			if(bloom_is_full || !packer.can_consume_all(group)) {
+				// bloomfilter is full or the group is too large, so they go into wo_vault
+				for(auto& kv : group) {
 					wo_vault->add(kv.key, dstr_with_id{.dstr=kv.value, .id=kv.id});
-					kv = merger.produce();
+					out->spilled.push_back(kv);
 				}
+				rs.spilled_pairs += group.size();
+				continue;
 			}
-			packer.consume(kv);
-			packed_num++;
+			for(auto& kv : group) {
+				packer.consume(kv);
+				out->min_id = std::min(out->min_id, kv.id);
+			}
+			packed_num += group.size();
+			last_key = group[0].key;
+			has_last_key = true;
 			if(bloom_size < BITS_PER_ENTRY * packed_num) {
 				packer.flush();
 				bloom_is_full = true;
 			}
 		}
 		packer.flush(); // it is a nop if already flushed
+		for(auto& reader : readers) {
+			if(reader->failed()) { // the row misses the pairs after the failed read
+				failed.store(true);
+				return;
+			}
+		}
 
 		bf256arr->at(row).rent([&new_bf, this](bloomfilter256* curr_bf) {
 			curr_bf->assign_at(this->new_vault_lsb, &new_bf);
 		});
+		out->bloom_words.resize(new_bf.word_count());
+		for(size_t i=0; i<out->bloom_words.size(); i++) {
+			out->bloom_words[i] = new_bf.get_word(i);
+		}
+
+		for(auto& reader : readers) {
+			rs.pages_in += reader->get_loaded_pages();
+			rs.dropped_pairs += reader->get_dropped_pairs();
+		}
+		rs.dropped_pairs += prod.get_dropped_pairs();
+		rs.pages_out = out->index.size();
+		rs.duration_us = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start_time).count();
+		record_row(row, rs);
 	}
-	void compact() {
-		for(int i=0; i<ROW_COUNT; i++) {
-			compact_row(i);
+	void record_row(int row, const compaction_row_stats& rs) {
+		std::lock_guard<std::mutex> lk(stats_mtx);
+		stats.rows[row] = rs;
+		stats.rows_done++;
+		auto& t = stats.total;
+		t.duration_us += rs.duration_us;
+		t.pages_in += rs.pages_in;
+		t.pages_out += rs.pages_out;
+		t.copied_pages += rs.copied_pages;
+		t.spilled_pairs += rs.spilled_pairs;
+		t.dropped_pairs += rs.dropped_pairs;
+		t.bloom_resizes += rs.bloom_resizes;
+		if(!event_log.is_open()) return;
+		event_log<<"compaction "<<stats.seq<<" row "<<row<<" us "<<rs.duration_us
+			<<" pages_in "<<rs.pages_in<<" pages_out "<<rs.pages_out<<" copied "<<rs.copied_pages
+			<<" spilled "<<rs.spilled_pairs<<" dropped "<<rs.dropped_pairs
+			<<" bloom_resizes "<<rs.bloom_resizes<<"\n";
+	}
+	void start_stats() {
+		std::lock_guard<std::mutex> lk(stats_mtx);
+		stats.seq++;
+		stats.running = true;
+		stats.merged_vaults = old_vaults.size();
+		stats.mem_bytes = ro_vault->packed_bytes();
+		stats.rows_started = resumed_rows;
+		stats.rows_done = resumed_rows;
+		stats.rows_resumed = resumed_rows;
+		stats.duration_us = 0;
+		stats.total = compaction_row_stats{};
+		stats.rows.assign(ROW_COUNT, compaction_row_stats{});
+		start_time = std::chrono::steady_clock::now();
+	}
+	void finish_stats() {
+		std::lock_guard<std::mutex> lk(stats_mtx);
+		stats.running = false;
+		stats.failed = failed.load();
+		stats.duration_us = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start_time).count();
+		if(!event_log.is_open()) return;
+		auto& t = stats.total;
+		event_log<<"compaction "<<stats.seq<<" done us "<<stats.duration_us
+			<<" merged_vaults "<<stats.merged_vaults<<" mem_bytes "<<stats.mem_bytes
+			<<" resumed_rows "<<stats.rows_resumed<<" failed "<<stats.failed
+			<<" pages_in "<<t.pages_in<<" pages_out "<<t.pages_out<<" copied "<<t.copied_pages
+			<<" spilled "<<t.spilled_pairs<<" dropped "<<t.dropped_pairs
+			<<" bloom_resizes "<<t.bloom_resizes<<std::endl;
+	}
+	void record_switch(int64_t us, uint64_t rw_entries) {
+		std::lock_guard<std::mutex> lk(stats_mtx);
+		stats.switch_count++;
+		stats.switch_us += us;
+		stats.max_rw_entries = std::max(stats.max_rw_entries, rw_entries);
+	}
+	void get_stats(compaction_stats* out) {
+		std::lock_guard<std::mutex> lk(stats_mtx);
+		*out = stats;
+		if(out->running) {
+			out->duration_us = std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - start_time).count();
 		}
+	}
+	// Append the telemetry to 'fname', or stop it if 'fname' is empty
+	bool open_event_log(const std::string& fname) {
+		std::lock_guard<std::mutex> lk(stats_mtx);
+		if(event_log.is_open()) {
+			event_log.close();
+		}
+		if(fname.empty()) return true;
+		event_log.open(fname, std::ios::app);
+		if(!event_log.is_open()) {
+			std::cerr<<"Failed to open file "<<fname<<std::endl;
+			return false;
+		}
+		return true;
+	}
+	// Append the pages of a compacted row to new vault. Every CHECKPOINT_ROWS rows, new vault is
+	// synced and then the rows are recorded in the checkpoint, so one sync covers a group of rows,
+	// and a crash redoes at most one group. Returns false if new vault cannot be written.
+	bool write_row(int row, row_output* out, vault_writer* writer) {
+		if(!writer->append(out->pages.data(), out->pages.size())) {
+			return false;
+		}
+		new_vault_min_id = std::min(new_vault_min_id, out->min_id);
+		for(ssize_t i=0; i<out->index.size(); i++) {
+			new_vault_index->append(out->index.get(i));
+		}
+		if(!checkpoint.is_open()) return true;
+		unsynced_rows.emplace_back();
+		auto& rc = unsynced_rows.back();
+		rc.row = row;
+		rc.end_offset = writer->end_offset();
+		rc.min_id = out->min_id;
+		rc.index.resize(out->index.size());
+		for(ssize_t i=0; i<out->index.size(); i++) {
+			rc.index[i] = out->index.get(i);
+		}
+		rc.bloom_words.swap(out->bloom_words);
+		rc.spilled.swap(out->spilled);
+		if(unsynced_rows.size() < CHECKPOINT_ROWS && row != ROW_COUNT-1) {
+			return true;
+		}
+		if(!writer->sync()) {
+			return false;
+		}
+		// a failure only makes the resumption start earlier
+		bool ok = true;
+		for(auto& unsynced : unsynced_rows) {
+			ok = ok && checkpoint.append_row(unsynced);
+		}
+		if(ok) checkpoint.sync_log();
+		unsynced_rows.clear();
+		return true;
+	}
+	// Make the bloomfilter at 'row' at least 'size' bits large, and return its size
+	size_t grow_bloomfilter(int row, size_t size) {
+		for(;;) {
+			size_t curr_size;
+			bloomfilter256* bf = nullptr; // a 2x enlarged bloomfilter
+			bf256arr->at(row).rent_const([&curr_size, &bf, size](const bloomfilter256* curr_bf) {
+				curr_size = curr_bf->size();
+				if(curr_size < size) {
+					bf = curr_bf->double_sized();
+				}
+			});
+			if(bf == nullptr) return curr_size;
+			bf256arr->at(row).replace(bf);
+		}
+	}
+	// restore a row in the checkpoint as if it had just been compacted and appended to new vault
+	void restore_row(const row_checkpoint& rc) {
+		for(auto key : rc.index) {
+			new_vault_index->append(key);
+		}
+		new_vault_min_id = std::min(new_vault_min_id, rc.min_id);
+		for(auto& kv : rc.spilled) {
+			wo_vault->add(kv.key, dstr_with_id{.dstr=kv.value, .id=kv.id});
+		}
+		// the bloomfilter may have been doubled since the row was recorded, then the saved
+		// bits are repeated to fill it
+		size_t size = grow_bloomfilter(rc.row, rc.bloom_words.size() * 64);
+		bloomfilter bf(size, seeds_for_bloom);
+		bf.fill_words(rc.bloom_words);
+		bf256arr->at(rc.row).rent([&bf, this](bloomfilter256* curr_bf) {
+			curr_bf->assign_at(this->new_vault_lsb, &bf);
+		});
+	}
+	// Start the checkpoint file 'num' of the compaction described by 'h'. If 'resume' is true and
+	// the file was written by the same compaction, which was interrupted by a crash, the recorded
+	// rows are restored and new vault is truncated after them. Otherwise new vault is emptied and
+	// a new checkpoint is started. It must be called after the other members are initialized.
+	// Returns how many rows are restored.
+	int open_checkpoint(int num, const checkpoint_header& h, bool resume) {
+		std::vector<row_checkpoint> rows;
+		unsynced_rows.clear();
+		resume = resume && checkpoint.load(num, h, &rows);
+		struct stat st;
+		if(resume && (fstat(new_vault_fd, &st) != 0 ||
+		   (!rows.empty() && rows.back().end_offset > st.st_size))) {
+			resume = false; // the vault file is not what the checkpoint says
+		}
+		for(size_t i=0; resume && i<rows.size(); i++) {
+			size_t size = grow_bloomfilter(rows[i].row, rows[i].bloom_words.size() * 64);
+			if(rows[i].bloom_words.empty() || size % (rows[i].bloom_words.size() * 64) != 0) {
+				resume = false; // the bloomfilter cannot be restored
+			}
+		}
+		if(!resume) rows.clear();
+		for(auto& rc : rows) {
+			restore_row(rc);
+		}
+		off_t end = rows.empty() ? 0 : rows.back().end_offset;
+		if(ftruncate(new_vault_fd, end) != 0) {
+			std::cerr<<"Failed to truncate new vault"<<std::endl;
+		}
+		if(!checkpoint.open(num, h, resume)) {
+			std::cerr<<"Compaction runs without checkpoint"<<std::endl;
+		}
+		resumed_rows = rows.size();
+		return resumed_rows;
+	}
+	// The rows are compacted in parallel by 'workers', each of which packs a row's pages into
+	// its own buffer. The rows are appended to new vault in order as soon as all the rows before
+	// them are done, so only the rows in flight are buffered. If new vault cannot be written, the
+	// remaining rows are skipped and 'failed' is set. Returns whether new vault is complete.
+	bool compact() {
+		start_stats();
+		// the new vault is about as large as the old vaults plus ro_vault
+		size_t expected_size = ro_vault->packed_bytes();
+		for(auto& ov : old_vaults) {
+			expected_size += ov.index->size() * PAGE_SIZE;
+		}
+		vault_writer writer(new_vault_fd, expected_size, true);
+		std::mutex stitch_mtx;
+		std::vector<std::unique_ptr<row_output>> outputs(ROW_COUNT);
+		int next_row = resumed_rows; // the next row to be appended to new vault
+		auto compact_one = [this, &writer, &stitch_mtx, &outputs, &next_row](int row) {
+			if(row < this->resumed_rows || this->failed.load()) return;
+			std::unique_ptr<row_output> out(new row_output);
+			out->min_id = INT64_MAX;
+			this->compact_row(row, out.get());
+			if(this->failed.load()) return;
+			this->limiter->request(out->pages.size()); // not throttled while holding the lock
+			std::lock_guard<std::mutex> lk(stitch_mtx);
+			outputs[row] = std::move(out);
+			for(; next_row < ROW_COUNT && outputs[next_row] != nullptr; next_row++) {
+				if(!this->write_row(next_row, outputs[next_row].get(), &writer)) {
+					this->failed.store(true);
+					return;
+				}
+				outputs[next_row].reset();
+			}
+		};
+		if(workers == nullptr) {
+			for(int i=0; i<ROW_COUNT; i++) {
+				compact_one(i);
+			}
+		} else {
+			workers->parallel_for(ROW_COUNT, compact_one);
+		}
+		bool ok = !failed.load() && writer.finish();
+		if(!ok) {
+			std::cerr<<"Compaction failed, and new vault will not be switched in"<<std::endl;
+			failed.store(true);
+		}
+		finish_stats();
 		done.store(true);
+		return ok;
 	}
 };
 
 class internalkv {
+	friend class internalkv_tester; // the white-box tests in 'test'
+	enum {
+		WARMUP_BATCH_SIZE = 256,
+		PARALLEL_APPLY_THRES = 4096, // smaller batches are applied in the calling thread
+		LOOKUP_TASK_SIZE = 64, // how many requests a task of '_lookup_batch' handles
+		MAX_MERGE_VAULTS = 16, // how many disk vaults a compaction merges at most
+	};
 	std::string     data_dir;
 	int             youngest_vault;
 	int             oldest_vault;
@@ -97,6 +507,7 @@ class internalkv {
 	vault_in_mem*   ro_vault;
 	int             vault_fd[VAULT_COUNT];
 	u64vec          vault_index[VAULT_COUNT];
+	int64_t         vault_min_id[VAULT_COUNT]; // the smallest id in each disk vault, INT64_MAX if empty and 0 if unknown
 	bitarray        del_mark;
 	seeds           seeds_for_bloom;
 
@@ -106,28 +517,121 @@ class internalkv {
 	std::array<ptr_for_rent<bloomfilter256>, ROW_COUNT> bf256arr;
 	int64_t next_id;
 
+	thread_pool      workers;
+
+	std::thread      warmup_thread; // pre-loads the hot keys saved at last shutdown into cache
+	std::atomic_bool stop_warmup;
+	std::mutex       warmup_mtx; // the warm-up thread and the writers take turns to access the vaults
+
+	// A batch whose log entries are accumulated in memory, which will be persisted and then applied
+	struct logged_batch {
+		batch_map*           batch;
+		batch_map            own_batch; // used by 'update_pipelined' to take the batch's content
+		std::vector<int64_t> del_ids; // sorted
+		int64_t              next_id;
+		int64_t              seq; // the write sequence number
+		std::string          rw_log_bytes;
+		std::string          del_log_bytes;
+	};
+	logged_batch*           pipeline_batch; // logged but not applied yet
+	logged_batch*           persist_job; // to be persisted by 'persist_thread'
+	bool                    stop_persist;
+	std::mutex              persist_mtx;
+	std::condition_variable persist_cv;
+	std::thread             persist_thread;
+
+	// a batch waiting in the queue of group commit
+	struct commit_req {
+		batch_map*    batch;
+		bool          done;
+		commit_result result;
+	};
+	std::mutex               commit_mtx;
+	std::condition_variable  commit_cv;
+	std::vector<commit_req*> commit_queue;
+	bool                     has_commit_leader;
+
+	// Each batch gets a write sequence number when it is logged. A background thread syncs the
+	// logs according to 'sync_mode', and callers can wait for a sequence number to be durable.
+	sync_policy              sync_mode;
+	int64_t                  sync_window_ms;
+	size_t                   sync_window_bytes;
+	std::atomic_llong        last_write_seq; // the sequence number of the last logged batch, read by 'wait_durable'
+	std::mutex               log_switch_mtx; // the log files cannot be switched while being synced
+	std::mutex               sync_mtx; // protects the following members
+	std::condition_variable  sync_cv;
+	int64_t                  written_seq; // the logs of the batches till it are written
+	int64_t                  synced_seq; // the logs of the batches till it are durable
+	int64_t                  requested_seq; // someone is waiting for the batches till it
+	int64_t                  failed_seq; // the first batch whose logs failed to be written or synced
+	size_t                   unsynced_bytes;
+	std::chrono::steady_clock::time_point first_unsynced_time;
+	bool                     stop_sync;
+	std::thread              sync_thread;
+
+	// The compaction started by 'switch_vaults_if_needed' runs in 'compaction_thread', and the
+	// scheduler in 'can_start_compaction' only switches the vaults after it is done.
+	compaction_policy        comp_policy;
+	std::chrono::steady_clock::time_point vault_birth[VAULT_COUNT]; // when each disk vault was created
+	std::mutex               compaction_mtx; // protects the following members
+	std::condition_variable  compaction_cv;
+	bool                     compaction_pending; // 'compactor' is initialized but not started
+	bool                     stop_compaction;
+	int64_t                  prune_pos; // del_mark is pruned till it before the next compaction
+	std::thread              compaction_thread;
+	std::unique_ptr<thread_pool> compaction_workers; // not shared with 'workers' to leave it to writes
+	rate_limiter             compaction_limiter; // shared by all the I/O of compaction
+
 	//void set_log_dir(const std::string& dir) {
 	//bool open_log(int num) {
-	void init_compactor() {
+	// Prepare the next compaction. If 'resume' is true, it continues from the checkpoint left by
+	// the same compaction before a crash, if there is one.
+	void init_compactor(bool resume) {
 		compactor.ro_vault = ro_vault;
 		compactor.del_mark = &del_mark;
 		compactor.seeds_for_bloom = &seeds_for_bloom;
 		compactor.bf256arr = &bf256arr;
 
 		compactor.wo_vault = new vault_in_mem;
-		compactor.wo_vault->set_log_dir(data_dir+MEM_VAULT_LOG_DIR);
+		compactor.wo_vault->set_log_dir(data_dir+"/"+MEM_VAULT_LOG_DIR);
 		compactor.wo_vault->open_log(youngest_vault+4); // new log for mem vault is created
 
 		compactor.new_vault_lsb = (youngest_vault+1)%VAULT_COUNT;
 		compactor.new_vault_index = &vault_index[compactor.new_vault_lsb];
+		compactor.new_vault_index->clear(); // it was used by the vault removed by 'done_compaction'
 		auto new_fname = data_dir+"/"+DISK_VAULT_DIR+"/"+std::to_string(youngest_vault+1);
-		compactor.new_vault_fd = open(new_fname.c_str(), O_RDWR); // new disk vault is created
+		// new disk vault is created, or truncated by 'open_checkpoint' after the restored rows
+		compactor.new_vault_fd = open(new_fname.c_str(), O_RDWR | O_CREAT, 0644);
+		compactor.new_vault_min_id = INT64_MAX;
 		vault_fd[compactor.new_vault_lsb] = compactor.new_vault_fd;
 
-		compactor.old_vault_index = &vault_index[oldest_vault%VAULT_COUNT];
-		compactor.old_vault_fd = vault_fd[oldest_vault%VAULT_COUNT];
+		compactor.old_vaults.clear();
+		for(int i=0; i<vaults_to_merge(); i++) {
+			int lsb = (oldest_vault+i)%VAULT_COUNT;
+			compactor.old_vaults.push_back({.index=&vault_index[lsb], .fd=vault_fd[lsb]});
+		}
+		compactor.checkpoint.set_log_dir(data_dir+"/"+CHECKPOINT_DIR);
+		int64_t old_vault_pages = 0;
+		for(auto& ov : compactor.old_vaults) {
+			old_vault_pages += ov.index->size();
+		}
+		checkpoint_header h{.new_vault=youngest_vault+1, .first_old_vault=oldest_vault,
+			.old_vault_count=int64_t(compactor.old_vaults.size()), .old_vault_pages=old_vault_pages,
+			.ro_entries=int64_t(ro_vault->size()), .ro_log_size=int64_t(ro_vault->log_file_size())};
+		compactor.open_checkpoint(youngest_vault+1, h, resume);
 		compactor.done.store(false);
 	}
+	// How many oldest disk vaults the next compaction merges. Usually it is only the oldest one, such
+	// that the count of live disk vaults is kept. When there are more than 'max_disk_vaults', more
+	// are merged to reduce the vaults probed by lookups.
+	int vaults_to_merge() {
+		int live = youngest_vault - oldest_vault + 1;
+		if(comp_policy.max_disk_vaults <= 0 || live <= comp_policy.max_disk_vaults) {
+			return 1;
+		}
+		// after the switch, the new vault is added and the merged ones are removed
+		return std::min(live + 1 - comp_policy.max_disk_vaults, int(MAX_MERGE_VAULTS));
+	}
 	//void save_meta() {
 	//	std::ofstream new_meta_file;
 	//	auto orig_meta_fname = data_dir+"/"+META_FILE;
@@ -155,24 +659,107 @@ class internalkv {
 		delete ro_vault;
 		ro_vault = rw_vault;
 		rw_vault = compactor.wo_vault;
+		vault_min_id[youngest_vault%VAULT_COUNT] = compactor.new_vault_min_id;
+		compactor.checkpoint.discard(); // the new vault is live now
 
-		close(vault_fd[(oldest_vault-1)%VAULT_COUNT]);
-		remove_file(data_dir+"/"+DISK_VAULT_DIR+"/"+std::to_string(oldest_vault-1));
-		remove_file(data_dir+"/"+DEL_LOG_DIR+"/"+std::to_string(oldest_vault-1));
+		// the merged vaults are the ones just before 'oldest_vault'
+		for(int num = oldest_vault - int(compactor.old_vaults.size()); num < oldest_vault; num++) {
+			int lsb = num%VAULT_COUNT;
+			if(lsb != (youngest_vault+1)%VAULT_COUNT) { // the next new vault is not looked up
+				for(int row=0; row<ROW_COUNT; row++) {
+					bf256arr[row].rent([lsb](bloomfilter256* curr_bf) {
+						curr_bf->clear_at(lsb);
+					});
+				}
+			}
+			vault_index[lsb].clear();
+			if(vault_fd[lsb] >= 0) {
+				close(vault_fd[lsb]);
+			}
+			vault_fd[lsb] = -1;
+			vault_min_id[lsb] = INT64_MAX;
+			remove_file(data_dir+"/"+DISK_VAULT_DIR+"/"+std::to_string(num));
+			remove_file(data_dir+"/"+DEL_LOG_DIR+"/"+std::to_string(num));
+		}
 
 		compactor.done.store(false);
 	}
 public:
-	internalkv(int count_for_bloom, const seeds& s): seeds_for_bloom(s) {
+	internalkv(int count_for_bloom, const seeds& s): seeds_for_bloom(s),
+	workers(std::thread::hardware_concurrency()) {
 		for(int i=0; i<ROW_COUNT; i++) {
 			bf256arr[i].replace(new bloomfilter256(count_for_bloom, &seeds_for_bloom));
 		}
+		for(int i=0; i<VAULT_COUNT; i++) {
+			vault_fd[i] = -1;
+			// The vaults opened at start are not scanned, so their ids are unknown and nothing
+			// is pruned until they are replaced by compactions or ingestion of this process.
+			vault_min_id[i] = 0;
+		}
 		rw_vault = new vault_in_mem;
 		ro_vault = new vault_in_mem;
+		stop_warmup.store(false);
+		has_commit_leader = false;
+		sync_mode = SYNC_NONE;
+		sync_window_ms = 0;
+		sync_window_bytes = 0;
+		last_write_seq.store(0);
+		written_seq = 0;
+		synced_seq = 0;
+		requested_seq = 0;
+		failed_seq = INT64_MAX;
+		unsynced_bytes = 0;
+		stop_sync = false;
+		pipeline_batch = nullptr;
+		persist_job = nullptr;
+		stop_persist = false;
+		compactor.wo_vault = nullptr;
+		compactor.workers = nullptr;
+		compactor.limiter = &compaction_limiter;
+		compactor.resumed_rows = 0;
+		compactor.done.store(true);
+		compactor.failed.store(false);
+		compactor.new_vault_min_id = INT64_MAX;
+		compactor.stats = compaction_stats{};
+		compactor.stats.rows.assign(ROW_COUNT, compaction_row_stats{});
+		comp_policy = compaction_policy{.rw_vault_entries=0, .mem_vault_entries=0, .max_vault_age_ms=0, .threads=1, .max_disk_vaults=0};
+		for(int i=0; i<VAULT_COUNT; i++) {
+			vault_birth[i] = std::chrono::steady_clock::now();
+		}
+		compaction_pending = false;
+		stop_compaction = false;
+		prune_pos = 0;
 	}
 	~internalkv() {
+		stop_warmup.store(true);
+		if(warmup_thread.joinable()) {
+			warmup_thread.join();
+		}
+		drain_pipeline();
+		if(persist_thread.joinable()) {
+			std::unique_lock<std::mutex> lk(persist_mtx);
+			stop_persist = true;
+			lk.unlock();
+			persist_cv.notify_all();
+			persist_thread.join();
+		}
+		if(sync_thread.joinable()) {
+			std::unique_lock<std::mutex> lk(sync_mtx);
+			stop_sync = true;
+			lk.unlock();
+			sync_cv.notify_all();
+			sync_thread.join();
+		}
+		if(compaction_thread.joinable()) { // a running compaction is finished first
+			std::unique_lock<std::mutex> lk(compaction_mtx);
+			stop_compaction = true;
+			lk.unlock();
+			compaction_cv.notify_all();
+			compaction_thread.join();
+		}
 		delete rw_vault;
 		delete ro_vault;
+		delete compactor.wo_vault;
 	}
 	internalkv(const internalkv& other) = delete;
 	internalkv& operator=(const internalkv& other) = delete;
@@ -200,22 +787,9 @@ private:
 		if(ro_vault->lookup(key, first_value, out, &del_mark)) {
 			return true;
 		}
-		bitslice mask;
-		auto row = row_from_key(key);
-		bf256arr[row].rent_const([&key, &mask](const bloomfilter256* bf_ptr) {
-			bf_ptr->get_mask(key, mask);
-		});
 		std::vector<uint8_t> pos_list;
-		for(int i = 0; i < 255; i++) {
-			auto pos = youngest_vault - i;
-			if(mask.get(pos)) {
-				pos_list.push_back(uint8_t(pos));
-			}
-		}
-		if(pos_list.size() == 0) {
-			return false;
-		}
-		for(int i=0; i<pos_list.size(); i++) {
+		get_candidate_vaults(key, &pos_list);
+		for(size_t i=0; i<pos_list.size(); i++) {
 			uint8_t vault_lsb = pos_list[i];
 			ssize_t pageid = vault_index[vault_lsb].search(key);
 			if(pageid < 0) {
@@ -223,7 +797,7 @@ private:
 			}
 			auto pageoff = pageid * PAGE_SIZE;
 			page pg;
-			auto sz = pread(vault_fd[vault_lsb], pg.data(), PAGE_SIZE, pageoff);
+			auto sz = timed_pread(vault_fd[vault_lsb], pg.data(), pageoff);
 			assert(sz == PAGE_SIZE);
 			bool ok = pg.lookup(key, first_value, out, &del_mark);
 			if(ok) {
@@ -232,51 +806,839 @@ private:
 		}
 		return false;
 	}
+	// read a page for lookup, whose latency is used to tune the rate of compaction I/O
+	ssize_t timed_pread(int fd, char* buf, off_t offset) {
+		auto start = std::chrono::steady_clock::now();
+		auto sz = pread(fd, buf, PAGE_SIZE, offset);
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+		compaction_limiter.record_latency(us.count());
+		return sz;
+	}
+	// Fill 'pos_list' with the disk vaults which may contain 'key', from young to old, according
+	// to the bloomfilters.
+	void get_candidate_vaults(uint64_t key, std::vector<uint8_t>* pos_list) {
+		bitslice mask;
+		auto row = row_from_key(key);
+		bf256arr[row].rent_const([&key, &mask](const bloomfilter256* bf_ptr) {
+			bf_ptr->get_mask(key, mask);
+		});
+		for(int i = 0; i < VAULT_COUNT-1; i++) {
+			int pos = ((youngest_vault - i) % VAULT_COUNT + VAULT_COUNT) % VAULT_COUNT;
+			if(mask.get(pos)) {
+				pos_list->push_back(uint8_t(pos));
+			}
+		}
+	}
+	// Look up all the requests in 'reqs' together. It gets the same results as calling '_lookup'
+	// one by one, but a page needed by several requests is read only once. If 'parallel' is true,
+	// the requests are looked up and the pages are read concurrently by 'workers'. Otherwise, the
+	// pages are read in the order of their positions in the vault files.
+	void _lookup_batch(std::vector<lookup_req>* reqs, bool parallel) {
+		typedef std::pair<uint8_t, ssize_t> page_pos; // (vault_lsb, pageid)
+		std::vector<std::vector<page_pos>> candidates(reqs->size());
+		int task_count = (reqs->size() + LOOKUP_TASK_SIZE - 1) / LOOKUP_TASK_SIZE;
+		run_tasks(parallel, task_count, [this, reqs, &candidates](int t) {
+			std::vector<uint8_t> pos_list;
+			size_t end = std::min(reqs->size(), size_t(t+1) * LOOKUP_TASK_SIZE);
+			for(size_t n = size_t(t) * LOOKUP_TASK_SIZE; n < end; n++) {
+				auto& req = reqs->at(n);
+				req.found = this->rw_vault->lookup(req.key, req.kstr, &req.out, &this->del_mark) ||
+					this->ro_vault->lookup(req.key, req.kstr, &req.out, &this->del_mark);
+				if(req.found) continue;
+				pos_list.clear();
+				this->get_candidate_vaults(req.key, &pos_list);
+				for(size_t i=0; i<pos_list.size(); i++) {
+					ssize_t pageid = this->vault_index[pos_list[i]].search(req.key);
+					if(pageid < 0) continue;
+					candidates[n].push_back(std::make_pair(pos_list[i], pageid));
+				}
+			}
+		});
+		std::map<page_pos, size_t> page_idx; // maps a page's position to its index in 'pages'
+		for(size_t n=0; n<candidates.size(); n++) {
+			for(auto& pp : candidates[n]) {
+				page_idx[pp] = 0;
+			}
+		}
+		std::vector<page_pos> positions;
+		positions.reserve(page_idx.size());
+		for(auto iter = page_idx.begin(); iter != page_idx.end(); iter++) {
+			iter->second = positions.size();
+			positions.push_back(iter->first);
+		}
+		std::vector<std::unique_ptr<page>> pages(positions.size());
+		run_tasks(parallel, positions.size(), [this, &positions, &pages](int i) {
+			pages[i].reset(new page);
+			auto pageoff = positions[i].second * PAGE_SIZE;
+			auto sz = this->timed_pread(this->vault_fd[positions[i].first], pages[i]->data(), pageoff);
+			assert(sz == PAGE_SIZE);
+		});
+		run_tasks(parallel, task_count, [this, reqs, &candidates, &page_idx, &pages](int t) {
+			size_t end = std::min(reqs->size(), size_t(t+1) * LOOKUP_TASK_SIZE);
+			for(size_t n = size_t(t) * LOOKUP_TASK_SIZE; n < end; n++) {
+				auto& req = reqs->at(n);
+				for(size_t i=0; !req.found && i<candidates[n].size(); i++) {
+					auto& pg = pages[page_idx.at(candidates[n][i])];
+					req.found = pg->lookup(req.key, req.kstr, &req.out, &this->del_mark);
+				}
+			}
+		});
+	}
+	// Run f(0), f(1), ... , f(n-1) with 'workers' or one by one in the calling thread
+	void run_tasks(bool parallel, int n, std::function<void(int)> f) {
+		if(parallel) {
+			workers.parallel_for(n, std::move(f));
+			return;
+		}
+		for(int i=0; i<n; i++) f(i);
+	}
+	// Load the hot keys batch by batch, and add the found KV pairs into cache, without changing
+	// the existing cache entries. At most 'keys_per_sec' keys are loaded in one second. Each
+	// batch holds 'warmup_mtx', so the vaults are not changed by the writers while it is looked
+	// up, and a value cannot be overwritten between its lookup and its insertion into cache.
+	void warm_up(std::vector<std::pair<uint64_t, std::string>> keys, size_t keys_per_sec) {
+		std::sort(keys.begin(), keys.end()); // keys in the same page are put into one batch
+		auto batch_time = std::chrono::microseconds(1000000 * WARMUP_BATCH_SIZE / keys_per_sec);
+		std::vector<lookup_req> reqs;
+		for(size_t start = 0; start < keys.size() && !stop_warmup.load(); start += WARMUP_BATCH_SIZE) {
+			auto deadline = std::chrono::steady_clock::now() + batch_time;
+			reqs.clear();
+			for(size_t i = start; i < keys.size() && i < start + WARMUP_BATCH_SIZE; i++) {
+				reqs.push_back(lookup_req{.key=keys[i].first, .kstr=keys[i].second, .out={}, .found=false});
+			}
+			std::unique_lock<std::mutex> lk(warmup_mtx);
+			_lookup_batch(&reqs, false); // do not compete with foreground for workers
+			for(auto& req : reqs) {
+				// the keys of 'pipeline_batch' may be changed by it, which is not applied yet
+				if(req.found && !key_in_pipeline(req.key)) {
+					cache.add_if_absent(req.key, req.kstr, req.out.str, req.out.id);
+				}
+			}
+			lk.unlock();
+			std::this_thread::sleep_until(deadline);
+		}
+	}
 public:
-	bool can_start_compaction(); //TODO
-	void update(btree::btree_multimap<uint64_t, dstr_with_id>* new_vault) {
-		if(can_start_compaction()) {
-			youngest_vault++;
-			oldest_vault++;
-			rw_vault->flush_log();
-			del_mark.log_rw_vault_log_size(compactor.wo_vault->log_file_size());
-			// new log for del_mark is created, which indicates id-switch
-			del_mark.switch_log(youngest_vault+1);
-			done_compaction();
-			init_compactor();
-		}
-		str_with_id str_and_id;
-		std::vector<uint64_t> del_ids;
-		for(auto iter = new_vault->begin(); iter != new_vault->end(); iter++) {
-			bool is_del = iter->second.id < 0;
-			if(is_del) {
-				bool found_it = lookup(iter->first, iter->second.dstr.kstr, &str_and_id);
-				if(found_it) {
-					del_ids.push_back(str_and_id.id);
-					del_mark.log_set(str_and_id.id);
+	void get_cache_stats(cache_stats* out) {
+		cache.get_stats(out);
+	}
+	// Save the keys of about 'count' hottest cache entries to a file, which will be used by
+	// 'start_warm_up' after restart. It should be called at shutdown.
+	bool save_hot_keys(size_t count) {
+		std::vector<std::pair<uint64_t, std::string>> keys;
+		cache.get_hot_keys(count, &keys);
+		auto fname = data_dir+"/"+HOT_KEYS_FILE;
+		auto new_fname = fname+".new";
+		std::ofstream fout;
+		fout.open(new_fname, std::ios::trunc | std::ios::binary);
+		if(!fout.is_open()) {
+			std::cerr<<"Failed to open file "<<new_fname<<std::endl;
+			return false;
+		}
+		for(auto& kv : keys) {
+			uint64_or_b8 key;
+			key.u64 = kv.first;
+			uint32_or_b4 size;
+			size.u32 = kv.second.size();
+			fout.write(key.b8, 8);
+			fout.write(size.b4, 4);
+			fout.write(kv.second.data(), kv.second.size());
+		}
+		fout.close();
+		if(fout.fail()) {
+			std::cerr<<"Failed to write file "<<new_fname<<std::endl;
+			return false;
+		}
+		return rename(new_fname.c_str(), fname.c_str()) == 0;
+	}
+	// Read the hot keys saved by 'save_hot_keys' and pre-load them into cache in background.
+	bool start_warm_up(size_t keys_per_sec) {
+		if(keys_per_sec == 0 || warmup_thread.joinable()) {
+			return false;
+		}
+		auto fname = data_dir+"/"+HOT_KEYS_FILE;
+		std::ifstream fin;
+		fin.open(fname, std::ios::in | std::ios::binary);
+		if(!fin.is_open()) {
+			std::cerr<<"Failed to open file "<<fname<<std::endl;
+			return false;
+		}
+		std::vector<std::pair<uint64_t, std::string>> keys;
+		for(;;) {
+			uint64_or_b8 key;
+			uint32_or_b4 size;
+			fin.read(key.b8, 8);
+			fin.read(size.b4, 4);
+			if(!fin.good()) break;
+			std::string kstr(size_t(size.u32), char(0));
+			fin.read(&kstr[0], kstr.size());
+			if(!fin.good()) break;
+			keys.push_back(std::make_pair(key.u64, std::move(kstr)));
+		}
+		warmup_thread = std::thread([this, keys = std::move(keys), keys_per_sec]() mutable {
+			this->warm_up(std::move(keys), keys_per_sec);
+		});
+		return true;
+	}
+private:
+	void _start_compaction(const compaction_policy& policy, bool resume) {
+		std::unique_lock<std::mutex> lk(compaction_mtx);
+		comp_policy = policy;
+		if(compaction_thread.joinable()) return;
+		if(policy.threads > 1) { // 'compaction_thread' itself is one of the threads
+			compaction_workers.reset(new thread_pool(policy.threads - 1));
+			compactor.workers = compaction_workers.get();
+		}
+		if(compactor.wo_vault == nullptr) {
+			init_compactor(resume);
+			compaction_pending = true;
+		}
+		compaction_thread = std::thread([this]() {this->compaction_loop();});
+	}
+public:
+	// Start the background compaction thread, which compacts the oldest disk vault (or several of
+	// them, see 'vaults_to_merge') and ro_vault into a new disk vault. Afterwards, the vaults are switched and the next compaction is started
+	// by the write path, when 'policy' says so. A checkpoint left by an earlier compaction is discarded.
+	void start_compaction(const compaction_policy& policy) {
+		_start_compaction(policy, false);
+	}
+	// The same as 'start_compaction', but it is used when the store is recovered after a crash, and
+	// the first compaction resumes from the checkpoint of the interrupted one, if its disk vaults and
+	// ro_vault are loaded the same as when it started.
+	void resume_compaction(const compaction_policy& policy) {
+		_start_compaction(policy, true);
+	}
+	// The scheduler of compaction. The vaults can be switched when the last compaction is done, and
+	// rw_vault is large enough, or the in-memory vaults are large enough together, or the oldest
+	// disk vault is too old. A switch drops ro_vault, which is in new vault now. If the compaction
+	// lags behind, rw_vault keeps growing instead of blocking the writers.
+	bool can_start_compaction() {
+		// a failed new vault is never switched in, and rw_vault keeps growing
+		if(!compactor.done.load() || compactor.failed.load()) return false;
+		std::lock_guard<std::mutex> lk(compaction_mtx);
+		if(!compaction_thread.joinable() || compaction_pending) return false;
+		auto rw_size = rw_vault->size();
+		if(comp_policy.rw_vault_entries != 0 && rw_size >= comp_policy.rw_vault_entries) {
+			return true;
+		}
+		if(comp_policy.mem_vault_entries != 0 && rw_size + ro_vault->size() >= comp_policy.mem_vault_entries) {
+			return true;
+		}
+		auto age = std::chrono::steady_clock::now() - vault_birth[oldest_vault%VAULT_COUNT];
+		return comp_policy.max_vault_age_ms != 0 && rw_size != 0 &&
+			age >= std::chrono::milliseconds(comp_policy.max_vault_age_ms);
+	}
+	// Cap the bytes per second read and written by compaction, 0 for unlimited
+	void set_compaction_rate(int64_t bytes_per_sec) {
+		compaction_limiter.set_rate(bytes_per_sec);
+	}
+	// Let the cap of compaction I/O back off when the average latency of the disk reads of lookups
+	// rises above 'target_us' microseconds, and recover when it drops
+	void set_compaction_auto_tune(int64_t min_bytes_per_sec, int64_t max_bytes_per_sec, int64_t target_us) {
+		compaction_limiter.set_auto_tune(min_bytes_per_sec, max_bytes_per_sec, target_us);
+	}
+	int64_t get_compaction_rate() {
+		return compaction_limiter.get_rate();
+	}
+	// Take a snapshot of the progress and the counters of compaction
+	void get_compaction_stats(compaction_stats* out) {
+		compactor.get_stats(out);
+		out->del_mark_pruned_pos = del_mark.get_pruned_pos();
+		out->del_mark_bytes = del_mark.memory_bytes();
+	}
+	// Append a line of telemetry to 'fname' for each compacted row and each compaction, or stop
+	// it if 'fname' is empty
+	bool set_compaction_event_log(const std::string& fname) {
+		return compactor.open_event_log(fname);
+	}
+	// Block until the running compaction is done
+	void wait_compaction() {
+		std::unique_lock<std::mutex> lk(compaction_mtx);
+		compaction_cv.wait(lk, [this]() {
+			return !this->compaction_pending && this->compactor.done.load();
+		});
+	}
+	// Choose when the logs are synced to disk. With SYNC_BY_WINDOW, they are synced by a
+	// background thread once 'window_bytes' bytes are written or 'window_ms' milliseconds have
+	// passed since the first unsynced write, whichever comes first. A bounded window of recent
+	// batches may be lost on power failure, unless their callers wait with 'wait_durable'.
+	void set_durability(sync_policy mode, int64_t window_ms, size_t window_bytes) {
+		drain_pipeline();
+		std::unique_lock<std::mutex> lk(sync_mtx);
+		sync_mode = mode;
+		sync_window_ms = window_ms;
+		sync_window_bytes = window_bytes;
+		rw_vault->set_sync_policy(mode);
+		del_mark.set_sync_policy(mode);
+		if(mode == SYNC_BY_WINDOW && !sync_thread.joinable()) {
+			sync_thread = std::thread([this]() {this->sync_loop();});
+		}
+		lk.unlock();
+		sync_cv.notify_all();
+	}
+	// Block until the logs of the batch with write sequence number 'seq' are durable. It syncs
+	// the logs at once instead of waiting for the window to close. Returns false if the logs of
+	// this batch or an earlier one failed to be written or synced, so this batch may be lost, or
+	// if 'seq' has not been given to any batch yet, which would never become durable by itself.
+	bool wait_durable(int64_t seq) {
+		std::unique_lock<std::mutex> lk(sync_mtx);
+		if(synced_seq >= seq) return true;
+		if(failed_seq <= seq) return false;
+		if(seq > last_write_seq.load()) {
+			std::cerr<<"Cannot wait for the batch "<<seq<<" which is not written yet"<<std::endl;
+			return false;
+		}
+		requested_seq = std::max(requested_seq, seq);
+		if(!sync_thread.joinable()) {
+			sync_thread = std::thread([this]() {this->sync_loop();});
+		}
+		sync_cv.notify_all();
+		sync_cv.wait(lk, [this, seq]() {return this->synced_seq >= seq || this->failed_seq <= seq;});
+		return synced_seq >= seq;
+	}
+	int64_t get_durable_seq() {
+		std::lock_guard<std::mutex> lk(sync_mtx);
+		return synced_seq;
+	}
+	// Write a batch and apply it. The same as 'update_pipelined' followed by 'drain_pipeline'.
+	// Returns its write sequence number.
+	int64_t update(batch_map* new_vault) {
+		std::lock_guard<std::mutex> warmup_lk(warmup_mtx);
+		_drain_pipeline();
+		switch_vaults_if_needed();
+		logged_batch lb;
+		lb.batch = new_vault;
+		log_batch(&lb);
+		persist_batch(&lb);
+		apply_batch(&lb);
+		return lb.seq;
+	}
+	// Write a batch in the pipelined way: the entries of 'new_vault' are logged in memory while
+	// the log of the previous batch is being written to disk in background. Then the previous
+	// batch is applied and this batch's log starts to be written. So the batches are persisted
+	// and applied strictly in order, and this batch is not visible to 'lookup' until the next
+	// call of 'update_pipelined', 'update' or 'drain_pipeline'.
+	// The content of 'new_vault' is moved away. Returns its write sequence number.
+	int64_t update_pipelined(batch_map* new_vault) {
+		std::lock_guard<std::mutex> warmup_lk(warmup_mtx);
+		switch_vaults_if_needed();
+		std::unique_ptr<logged_batch> lb(new logged_batch);
+		lb->own_batch.swap(*new_vault);
+		lb->batch = &lb->own_batch;
+		log_batch(lb.get()); // overlaps with persisting 'pipeline_batch'
+		int64_t seq = lb->seq;
+		_drain_pipeline();
+		if(!persist_thread.joinable()) {
+			persist_thread = std::thread([this]() {this->persist_loop();});
+		}
+		std::unique_lock<std::mutex> lk(persist_mtx);
+		pipeline_batch = lb.release();
+		persist_job = pipeline_batch;
+		lk.unlock();
+		persist_cv.notify_all();
+		return seq;
+	}
+	// Wait until the batch in the pipeline is persisted and then apply it
+	void drain_pipeline() {
+		std::lock_guard<std::mutex> warmup_lk(warmup_mtx);
+		_drain_pipeline();
+	}
+private:
+	void _drain_pipeline() {
+		if(pipeline_batch == nullptr) return;
+		std::unique_lock<std::mutex> lk(persist_mtx);
+		persist_cv.wait(lk, [this]() {return this->persist_job == nullptr;});
+		lk.unlock();
+		apply_batch(pipeline_batch);
+		delete pipeline_batch;
+		pipeline_batch = nullptr;
+	}
+public:
+	// Import a stream of KV pairs sorted by key straight into a disk vault, bypassing the logs,
+	// the in-memory vaults and compaction, such that every byte is written only once. The keys
+	// must not exist in the database, which is the case for loading a snapshot into a new
+	// database. The pairs are packed into the pages of a temporary file, while the vault index
+	// and a bloomfilter for each row are built. After the file is synced, 'next_id' is logged and
+	// synced, and the file is renamed to an empty vault's file. Then the index is installed and at
+	// last the bloomfilters make the vault visible.
+	// It must not run concurrently with other writes. Returns the count of imported pairs, or -1
+	// on failure, in which case nothing is installed.
+	int64_t ingest(kv_producer* prod) {
+		std::lock_guard<std::mutex> warmup_lk(warmup_mtx);
+		_drain_pipeline();
+		wait_compaction(); // compaction may resize the bloomfilters
+		int vault_num = find_empty_vault();
+		if(vault_num < 0) {
+			std::cerr<<"No empty vault for ingestion"<<std::endl;
+			return -1;
+		}
+		uint8_t vault_lsb = vault_num % VAULT_COUNT;
+		auto fname = data_dir+"/"+DISK_VAULT_DIR+"/"+std::to_string(vault_num);
+		auto tmp_fname = fname+".ingest";
+		int fd = open(tmp_fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0) {
+			std::cerr<<"Failed to open file "<<tmp_fname<<std::endl;
+			return -1;
+		}
+		u64vec index;
+		std::vector<std::unique_ptr<bloomfilter>> row_bf(ROW_COUNT);
+		std::vector<uint64_t> row_keys;
+		std::vector<kv_pair> group; // the pairs with the same key must be put in one page
+		vault_writer writer(fd, 0, true);
+		kv_packer packer(&writer, nullptr, &index);
+		int64_t count = 0;
+		int64_t first_id = next_id;
+		uint64_t last_key = 0;
+		int curr_row = -1;
+		bool ok = true;
+		auto finish_row = [this, &row_bf, &row_keys, &packer](int row) {
+			if(!packer.flush()) return false; // pages never span rows
+			size_t size = this->ensure_bloomfilter_size(row, row_keys.size());
+			row_bf[row].reset(new bloomfilter(size, &this->seeds_for_bloom));
+			for(auto key : row_keys) {
+				row_bf[row]->add(key);
+			}
+			row_keys.clear();
+			return true;
+		};
+		while(ok && prod->valid()) {
+			group.clear();
+			group.push_back(prod->produce());
+			while(prod->valid() && prod->peek().key == group[0].key) {
+				group.push_back(prod->produce());
+			}
+			int row = row_from_key(group[0].key);
+			if(count != 0 && group[0].key <= last_key) {
+				std::cerr<<"The ingested keys are not sorted"<<std::endl;
+				ok = false;
+				break;
+			}
+			if(row != curr_row) {
+				if(curr_row >= 0 && !finish_row(curr_row)) {
+					ok = false;
+					break;
+				}
+				curr_row = row;
+			}
+			if(!packer.can_consume_all(group)) {
+				if(!packer.flush()) {
+					ok = false;
+					break;
 				}
+				if(!packer.can_consume_all(group)) {
+					std::cerr<<"Too many ingested pairs share one key"<<std::endl;
+					ok = false;
+					break;
+				}
+			}
+			for(auto& kv : group) {
+				kv.id = next_id++;
+				packer.consume(kv);
+				count++;
+			}
+			row_keys.push_back(group[0].key);
+			last_key = group[0].key;
+		}
+		if(ok && curr_row >= 0) ok = finish_row(curr_row);
+		ok = ok && writer.finish() && fdatasync(fd) == 0 && log_next_id() &&
+			rename(tmp_fname.c_str(), fname.c_str()) == 0;
+		if(!ok) {
+			std::cerr<<"Failed to ingest into "<<fname<<std::endl;
+			close(fd);
+			remove_file(tmp_fname);
+			return -1;
+		}
+		for(int row=0; row<ROW_COUNT; row++) { // stale bits must not lead lookups to the new index
+			bf256arr[row].rent([vault_lsb](bloomfilter256* curr_bf) {
+				curr_bf->clear_at(vault_lsb);
+			});
+		}
+		vault_index[vault_lsb].clear();
+		for(ssize_t i=0; i<index.size(); i++) {
+			vault_index[vault_lsb].append(index.get(i));
+		}
+		if(vault_fd[vault_lsb] >= 0) {
+			close(vault_fd[vault_lsb]);
+		}
+		vault_fd[vault_lsb] = fd;
+		vault_min_id[vault_lsb] = count == 0 ? INT64_MAX : first_id;
+		// the age trigger of compaction must not see the birth of the vault which used this slot
+		std::unique_lock<std::mutex> lk(compaction_mtx);
+		vault_birth[vault_lsb] = std::chrono::steady_clock::now();
+		lk.unlock();
+		for(int row=0; row<ROW_COUNT; row++) {
+			if(row_bf[row] == nullptr) continue;
+			bf256arr[row].rent([&row_bf, row, vault_lsb](bloomfilter256* curr_bf) {
+				curr_bf->assign_at(vault_lsb, row_bf[row].get());
+			});
+		}
+		cache.drop_negative();
+		return count;
+	}
+private:
+	// Make 'next_id' durable in del_mark's log, the same way as 'log_batch' records it, such that
+	// the ids assigned by 'ingest' without any log are not reused after restart
+	bool log_next_id() {
+		del_mark.log_clear(next_id);
+		if(del_mark.flush_log() && del_mark.sync_log()) {
+			return true;
+		}
+		std::lock_guard<std::mutex> lk(sync_mtx);
+		mark_failed(last_write_seq+1); // the log may end with a partial frame
+		return false;
+	}
+	// Find the youngest disk vault which has no pages, except the oldest ones, which are being
+	// compacted. Returns its number or -1 if there is none.
+	int find_empty_vault() {
+		int first_free = oldest_vault + std::max(int(compactor.old_vaults.size()), 1);
+		for(int num = youngest_vault; num >= first_free; num--) {
+			if(vault_index[num%VAULT_COUNT].size() == 0) {
+				return num;
+			}
+		}
+		return -1;
+	}
+	// Enlarge the bloomfilter at 'row' until it can hold 'count' more keys, and return its size
+	size_t ensure_bloomfilter_size(int row, size_t count) {
+		for(;;) {
+			size_t size;
+			bloomfilter256* bf = nullptr; // a 2x enlarged bloomfilter
+			bf256arr[row].rent_const([&size, &bf, count](const bloomfilter256* curr_bf) {
+				size = curr_bf->size();
+				if(size < BITS_PER_ENTRY * count) {
+					bf = curr_bf->double_sized();
+				}
+			});
+			if(bf == nullptr) return size;
+			bf256arr[row].replace(bf);
+		}
+	}
+	void switch_vaults_if_needed() {
+		if(!can_start_compaction()) return;
+		auto start = std::chrono::steady_clock::now();
+		uint64_t rw_entries = rw_vault->size();
+		_drain_pipeline();
+		std::lock_guard<std::mutex> switch_lk(log_switch_mtx);
+		youngest_vault++;
+		oldest_vault += compactor.old_vaults.size();
+		bool ok = rw_vault->flush_log();
+		del_mark.log_rw_vault_log_size(compactor.wo_vault->log_file_size());
+		ok = ok && del_mark.flush_log();
+		if(sync_mode != SYNC_NONE) { // the old logs must be durable before they are closed
+			ok = ok && rw_vault->sync_log() && del_mark.sync_log();
+		}
+		std::unique_lock<std::mutex> sync_lk(sync_mtx);
+		if(!ok) {
+			mark_failed(synced_seq+1);
+		} else if(sync_mode != SYNC_NONE) {
+			mark_synced(written_seq);
+			unsynced_bytes = 0;
+		}
+		sync_lk.unlock();
+		sync_cv.notify_all();
+		// new log for del_mark is created, which indicates id-switch
+		del_mark.switch_log(youngest_vault+1);
+		done_compaction();
+		init_compactor(false);
+		rw_vault->set_sync_policy(sync_mode);
+		compactor.record_switch(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start).count(), rw_entries);
+		int64_t min_id = min_live_id();
+		std::unique_lock<std::mutex> lk(compaction_mtx);
+		vault_birth[(youngest_vault+1)%VAULT_COUNT] = std::chrono::steady_clock::now();
+		prune_pos = min_id;
+		compaction_pending = true;
+		lk.unlock();
+		compaction_cv.notify_all();
+	}
+	// The smallest id which may be used by a kv pair, in the vaults or assigned later. The ids
+	// before it are never looked up except through stale cache entries, so del_mark can drop them.
+	int64_t min_live_id() {
+		int64_t res = std::min(next_id, std::min(rw_vault->min_id(), ro_vault->min_id()));
+		for(int num = oldest_vault; num <= youngest_vault; num++) {
+			res = std::min(res, vault_min_id[num%VAULT_COUNT]);
+		}
+		return res;
+	}
+	// The loop of 'compaction_thread', which runs the compactions started by the write path
+	void compaction_loop() {
+		std::unique_lock<std::mutex> lk(compaction_mtx);
+		for(;;) {
+			compaction_cv.wait(lk, [this]() {return this->stop_compaction || this->compaction_pending;});
+			if(stop_compaction) return;
+			int64_t pos = prune_pos;
+			lk.unlock();
+			del_mark.prune_till(pos); // the memory of the ids not used any more is released
+			compactor.compact(); // sets 'done' when all the rows are compacted, or 'failed'
+			lk.lock();
+			compaction_pending = false;
+			compaction_cv.notify_all();
+		}
+	}
+	// Look up the ids to be deleted for all the requests, including the entries in 'pipeline_batch'
+	// which are logged but not applied yet. The results are the same as calling 'lookup' one by one,
+	// but the requests missing in cache are looked up together by '_lookup_batch'.
+	void lookup_for_del(std::vector<lookup_req>* reqs) {
+		std::vector<lookup_req> disk_reqs;
+		std::vector<size_t> disk_idx;
+		for(size_t n=0; n<reqs->size(); n++) {
+			auto& req = reqs->at(n);
+			req.found = false;
+			if(lookup_in_pipeline(req.key, req.kstr, &req.out)) {
+				req.found = true;
+				continue;
+			}
+			if(cache.lookup(req.key, req.kstr, &req.out)) {
+				if(req.out.id < 0) continue; // known to be absent
+				if(!del_mark.get(req.out.id)) {
+					req.found = true;
+					continue;
+				}
+			}
+			disk_idx.push_back(n);
+			disk_reqs.push_back(req);
+		}
+		_lookup_batch(&disk_reqs, true);
+		for(size_t i=0; i<disk_idx.size(); i++) {
+			reqs->at(disk_idx[i]) = std::move(disk_reqs[i]);
+		}
+		if(pipeline_batch == nullptr) return;
+		// filter out the ones deleted by 'pipeline_batch' but not marked in 'del_mark' yet
+		auto& ids = pipeline_batch->del_ids;
+		for(auto& req : *reqs) {
+			if(req.found && std::binary_search(ids.begin(), ids.end(), req.out.id)) {
+				req.found = false;
+			}
+		}
+	}
+	// Whether 'key' is written by 'pipeline_batch'
+	bool key_in_pipeline(uint64_t key) {
+		if(pipeline_batch == nullptr) return false;
+		auto m = pipeline_batch->batch;
+		return m->find(key) != m->end();
+	}
+	// Look up the new entries of 'pipeline_batch'
+	bool lookup_in_pipeline(uint64_t key, const std::string& key_str, str_with_id* out) {
+		if(pipeline_batch == nullptr) return false;
+		auto m = pipeline_batch->batch;
+		for(auto it = m->find(key); it != m->end() && it->first == key; it++) {
+			if(it->second.id >= 0 && it->second.dstr.kstr == key_str) {
+				out->str = it->second.dstr.vstr;
+				out->id = it->second.id;
+				return true;
+			}
+		}
+		return false;
+	}
+	// Assign ids to the new entries and accumulate the log entries of 'lb' in memory
+	void log_batch(logged_batch* lb) {
+		std::vector<lookup_req> reqs;
+		for(auto iter = lb->batch->begin(); iter != lb->batch->end(); iter++) {
+			if(iter->second.id < 0) {
+				reqs.push_back(lookup_req{.key=iter->first, .kstr=iter->second.dstr.kstr, .out={}, .found=false});
+			}
+		}
+		// all the deletions are resolved before any new entry of this batch is added
+		lookup_for_del(&reqs);
+		for(auto& req : reqs) {
+			if(req.found) {
+				lb->del_ids.push_back(req.out.id);
+				del_mark.log_set(req.out.id);
+			}
+		}
+		for(auto iter = lb->batch->begin(); iter != lb->batch->end(); iter++) {
+			if(iter->second.id < 0) continue;
+			auto& v = iter->second;
+			v.id = next_id++;
+			rw_vault->log_add_kv(iter->first, v);
+		}
+		std::sort(lb->del_ids.begin(), lb->del_ids.end());
+		lb->next_id = next_id;
+		lb->seq = ++last_write_seq;
+		del_mark.log_clear(next_id);
+		rw_vault->take_log_bytes(&lb->rw_log_bytes);
+		del_mark.log_rw_vault_log_size(rw_vault->log_file_size());
+		del_mark.take_log_bytes(&lb->del_log_bytes);
+	}
+	// Write the log of 'lb' to disk. It only accesses the log files.
+	void persist_batch(logged_batch* lb) {
+		// del_mark's log records the size of rw_vault's log, so it is not written if the latter fails
+		bool ok = rw_vault->write_log_bytes(lb->rw_log_bytes) &&
+			del_mark.write_log_bytes(lb->del_log_bytes);
+		std::unique_lock<std::mutex> lk(sync_mtx);
+		if(!ok) {
+			mark_failed(lb->seq);
+		} else if(sync_mode == SYNC_EACH_WRITE) { // already synced by 'write_log_bytes'
+			written_seq = lb->seq;
+			mark_synced(lb->seq);
+		} else {
+			written_seq = lb->seq;
+			if(unsynced_bytes == 0) {
+				first_unsynced_time = std::chrono::steady_clock::now();
+			}
+			unsynced_bytes += lb->rw_log_bytes.size() + lb->del_log_bytes.size();
+		}
+		lk.unlock();
+		sync_cv.notify_all();
+	}
+	// The batches till 'seq' are durable, unless an earlier one failed. 'sync_mtx' must be held.
+	void mark_synced(int64_t seq) {
+		synced_seq = std::max(synced_seq, std::min(seq, failed_seq-1));
+	}
+	// The logs of the batches from 'seq' on may be lost. The logs may end with a partial frame, so
+	// no later batch becomes durable either. 'sync_mtx' must be held.
+	void mark_failed(int64_t seq) {
+		failed_seq = std::min(failed_seq, seq);
+	}
+	// Whether the logs written till now need to be synced by 'sync_loop'
+	bool need_sync() {
+		if(written_seq <= synced_seq || failed_seq <= synced_seq+1) return false;
+		if(requested_seq > synced_seq) return true;
+		if(sync_mode != SYNC_BY_WINDOW) return false;
+		if(unsynced_bytes >= sync_window_bytes) return true;
+		auto deadline = first_unsynced_time + std::chrono::milliseconds(sync_window_ms);
+		return std::chrono::steady_clock::now() >= deadline;
+	}
+	// The background thread which syncs the written logs, in the order of rw_vault's log and
+	// then del_mark's log, which contains the size of rw_vault's log.
+	void sync_loop() {
+		std::unique_lock<std::mutex> lk(sync_mtx);
+		while(!stop_sync) {
+			if(!need_sync()) {
+				if(sync_mode == SYNC_BY_WINDOW && written_seq > synced_seq) {
+					sync_cv.wait_until(lk, first_unsynced_time + std::chrono::milliseconds(sync_window_ms));
+				} else {
+					sync_cv.wait(lk);
+				}
+				continue;
+			}
+			int64_t seq = written_seq;
+			unsynced_bytes = 0;
+			lk.unlock();
+			bool ok;
+			{
+				std::lock_guard<std::mutex> switch_lk(log_switch_mtx);
+				ok = rw_vault->sync_log() && del_mark.sync_log();
+			}
+			lk.lock();
+			if(ok) {
+				mark_synced(seq);
 			} else {
+				mark_failed(synced_seq+1);
+			}
+			sync_cv.notify_all();
+		}
+	}
+	// Make the entries of 'lb' visible, after its log is persisted
+	void apply_batch(logged_batch* lb) {
+		for(size_t i=0; i < lb->del_ids.size(); i++) {
+			del_mark.set(lb->del_ids[i]);
+		}
+		batch_map* m = lb->batch;
+		if(m->size() < PARALLEL_APPLY_THRES) {
+			add_to_rw_vault(m->begin(), m->end());
+		} else {
+			// the keys are sorted, so the entries of each row are continuous in 'm', and
+			// different rows of rw_vault can be changed in parallel.
+			workers.parallel_for(ROW_COUNT, [this, m](int row) {
+				auto end = row+1 == ROW_COUNT ? m->end() : m->lower_bound(row_to_key(row+1));
+				this->add_to_rw_vault(m->lower_bound(row_to_key(row)), end);
+			});
+		}
+		del_mark.clear(lb->next_id);
+	}
+	void add_to_rw_vault(batch_map::iterator begin, batch_map::iterator end) {
+		for(auto iter = begin; iter != end; iter++) {
+			if(iter->second.id >= 0) {
 				auto& v = iter->second;
-				v.id = next_id++;
+				rw_vault->add(iter->first, v);
 				cache.add(iter->first, v.dstr.kstr, v.dstr.vstr, v.id);
-				rw_vault->log_add_kv(iter->first, v);
 			}
 		}
-		del_mark.log_clear(next_id);
+	}
+	// The background thread persisting the batches of 'update_pipelined'
+	void persist_loop() {
+		std::unique_lock<std::mutex> lk(persist_mtx);
+		for(;;) {
+			persist_cv.wait(lk, [this]() {return this->persist_job != nullptr || this->stop_persist;});
+			if(persist_job == nullptr) return;
+			lk.unlock();
+			persist_batch(persist_job);
+			lk.lock();
+			persist_job = nullptr;
+			persist_cv.notify_all();
+		}
+	}
+public:
+	// Several threads can call it concurrently to write their batches. The first caller becomes
+	// the leader, which takes all the queued batches, merges them and writes them with one call to
+	// 'update', such that they share one log flush. The other callers wait for the leader.
+	commit_result commit(batch_map* batch) {
+		commit_req req{.batch=batch, .done=false, .result={}};
+		std::unique_lock<std::mutex> lk(commit_mtx);
+		commit_queue.push_back(&req);
+		commit_cv.wait(lk, [this, &req]() {return req.done || !this->has_commit_leader;});
+		if(req.done) {
+			return req.result;
+		}
+		has_commit_leader = true;
+		std::vector<commit_req*> group;
+		group.swap(commit_queue);
+		lk.unlock();
 
-		rw_vault->flush_log();
-		del_mark.log_rw_vault_log_size(rw_vault->log_file_size());
-		del_mark.flush_log();
+		int64_t seq;
+		if(group.size() == 1) {
+			seq = update(batch);
+		} else {
+			batch_map merged;
+			for(auto r : group) {
+				merge_batch(&merged, *r->batch);
+			}
+			seq = update(&merged);
+		}
 
-		for(int i=0; i < del_ids.size(); i++) {
-			del_mark.set(del_ids[i]);
+		lk.lock();
+		for(auto r : group) {
+			r->result = commit_result{.seq=seq, .group_size=int(group.size())};
+			r->done = true;
 		}
-		for(auto iter = new_vault->begin(); iter != new_vault->end(); iter++) {
-			if(iter->second.id >= 0) {
-				rw_vault->add(iter->first, iter->second);
+		has_commit_leader = false;
+		lk.unlock();
+		commit_cv.notify_all();
+		return req.result;
+	}
+private:
+	// The deletion (if 'is_del') or insertion of 'key' and 'kstr' in 'batch', or batch->end() if
+	// there is none. The btree iterators are returned instead of assigned, since their copy
+	// assignment is deprecated.
+	static batch_map::iterator find_in_batch(batch_map* batch, uint64_t key, const std::string& kstr, bool is_del) {
+		for(auto it = batch->find(key); it != batch->end() && it->first == key; it++) {
+			if(it->second.dstr.kstr == kstr && (it->second.id < 0) == is_del) return it;
+		}
+		return batch->end();
+	}
+	// Merge 'batch' into 'merged', with the same effect as writing them one after another: for
+	// each key there is at most one deletion followed by at most one insertion, and a later
+	// insertion overwrites an earlier one, while a later deletion cancels the earlier insertion.
+	static void merge_batch(batch_map* merged, const batch_map& batch) {
+		for(auto iter = batch.begin(); iter != batch.end(); iter++) {
+			const auto& kstr = iter->second.dstr.kstr;
+			auto ins_pos = find_in_batch(merged, iter->first, kstr, false);
+			bool is_del = iter->second.id < 0;
+			if(is_del) {
+				bool has_del = find_in_batch(merged, iter->first, kstr, true) != merged->end();
+				if(ins_pos != merged->end()) {
+					merged->erase(ins_pos);
+				}
+				if(!has_del) {
+					merged->insert(*iter);
+				}
+			} else if(ins_pos != merged->end()) {
+				ins_pos->second.dstr.vstr = iter->second.dstr.vstr;
+			} else {
+				merged->insert(*iter); // placed after the deletion of the same key, if any
 			}
 		}
-		del_mark.clear(next_id);
 	}
 };
 
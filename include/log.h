@@ -2,9 +2,14 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "common.h"
+#include "crc32c.h"
 
 namespace moeingkv {
 
@@ -65,96 +70,438 @@ inline bool delete_useless_logs(const std::string& log_dir, const std::vector<in
 	return true;
 }
 
+enum __log_format_t {
+	LOG_FILE_HEADER_SIZE = 8, // the magic bytes at the beginning of a framed log file
+	FRAME_HEADER_SIZE = 8, // 4-byte payload length and 4-byte CRC32C of the payload
+	// the encodings of log entries, recorded in the first byte of each frame's payload
+	LOG_ENCODING_RAW = 1, // fixed-sized integers and u32-prefixed strings
+	LOG_ENCODING_COMPACT = 2, // varints and delta-coded ids, used by vault_in_mem
+};
+#define LOG_FILE_MAGIC ("MKVLOG02") // each frame's payload begins with the encoding byte
+#define LOG_FILE_MAGIC_V1 ("MKVLOG01") // all the frames' payloads use LOG_ENCODING_RAW
+
+// When to call fdatasync after the log bytes are written to the log file
+enum sync_policy {
+	SYNC_NONE, // leave the log bytes in the OS page cache
+	SYNC_EACH_WRITE, // fdatasync after each write
+	SYNC_BY_WINDOW, // the owner calls 'sync_log' once per time or size window
+};
+
+// write all the bytes to fd, retrying on partial writes and interrupts
+inline bool write_all(int fd, const char* data, size_t size) {
+	while(size > 0) {
+		ssize_t n = write(fd, data, size);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return false;
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+// A read-only memory mapping of a whole file
+class mapped_file {
+	const char* ptr;
+	size_t      sz;
+public:
+	mapped_file(): ptr(nullptr), sz(0) {}
+	~mapped_file() {
+		unmap();
+	}
+	mapped_file(const mapped_file& other) = delete;
+	mapped_file& operator=(const mapped_file& other) = delete;
+	mapped_file(mapped_file&& other) = delete;
+	mapped_file& operator=(mapped_file&& other) = delete;
+
+	bool map(const std::string& fname) {
+		unmap();
+		int fd = open(fname.c_str(), O_RDONLY);
+		if(fd < 0) {
+			std::cerr<<"Failed to open file "<<fname<<std::endl;
+			return false;
+		}
+		struct stat st;
+		if(fstat(fd, &st) != 0) {
+			std::cerr<<"Failed to stat file "<<fname<<std::endl;
+			close(fd);
+			return false;
+		}
+		sz = st.st_size;
+		if(sz != 0) { // an empty file cannot be mapped
+			void* p = mmap(nullptr, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(p == MAP_FAILED) {
+				std::cerr<<"Failed to mmap file "<<fname<<std::endl;
+				sz = 0;
+				close(fd);
+				return false;
+			}
+			madvise(p, sz, MADV_SEQUENTIAL | MADV_WILLNEED);
+			ptr = (const char*)p;
+		}
+		close(fd);
+		return true;
+	}
+	void unmap() {
+		if(ptr != nullptr) {
+			munmap((void*)ptr, sz);
+		}
+		ptr = nullptr;
+		sz = 0;
+	}
+	const char* data() const {
+		return ptr;
+	}
+	size_t size() const {
+		return sz;
+	}
+};
+
+// The payload of one frame in a log file, excluding the encoding byte
+struct log_frame {
+	const char* data;
+	size_t      size;
+	int         encoding;
+};
+
+// Whether the mapped log file is written in the oldest format, which has no magic and no frames
+inline bool is_unframed_log(const mapped_file& content) {
+	if(content.size() < LOG_FILE_HEADER_SIZE) return true;
+	return memcmp(content.data(), LOG_FILE_MAGIC_V1, LOG_FILE_HEADER_SIZE) != 0 &&
+		memcmp(content.data(), LOG_FILE_MAGIC, LOG_FILE_HEADER_SIZE) != 0;
+}
+
+// Map the whole log file 'fname' to 'content', and fill 'frames' with its valid frames, which
+// point into 'content'. A framed log file begins with a magic and then contains frames, each of
+// which has a FRAME_HEADER_SIZE-byte header followed by the payload. The frames after a torn or
+// corrupted one are ignored, and if 'cut_torn_tail' is true, the file is truncated to its valid
+// part. A log file without magic is written in the oldest format, and its whole content is
+// returned as one frame.
+inline bool read_log_file(const std::string& fname, mapped_file* content,
+	std::vector<log_frame>* frames, bool cut_torn_tail) {
+	if(!content->map(fname)) {
+		return false;
+	}
+	frames->clear();
+	if(is_unframed_log(*content)) {
+		frames->push_back(log_frame{.data=content->data(), .size=content->size(),
+			.encoding=LOG_ENCODING_RAW});
+		return true;
+	}
+	bool is_v1 = memcmp(content->data(), LOG_FILE_MAGIC_V1, LOG_FILE_HEADER_SIZE) == 0;
+	size_t pos = LOG_FILE_HEADER_SIZE;
+	while(pos + FRAME_HEADER_SIZE <= content->size()) {
+		uint32_or_b4 len, crc;
+		memcpy(len.b4, content->data()+pos, 4);
+		memcpy(crc.b4, content->data()+pos+4, 4);
+		size_t end = pos + FRAME_HEADER_SIZE + len.u32;
+		if(end > content->size()) break;
+		const char* payload = content->data() + pos + FRAME_HEADER_SIZE;
+		if(crc32c::value(payload, len.u32) != crc.u32) break;
+		if(is_v1) {
+			frames->push_back(log_frame{.data=payload, .size=len.u32, .encoding=LOG_ENCODING_RAW});
+		} else if(len.u32 > 0) {
+			frames->push_back(log_frame{.data=payload+1, .size=len.u32-1, .encoding=int(payload[0])});
+		}
+		pos = end;
+	}
+	if(pos != content->size()) {
+		std::cerr<<"Torn or corrupted log found in "<<fname<<" at "<<pos<<std::endl;
+		if(cut_torn_tail && truncate(fname.c_str(), pos) != 0) {
+			std::cerr<<"Failed to truncate "<<fname<<std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// It reads the fields of log entries from a memory buffer
+class log_reader {
+	const char* ptr;
+	const char* end;
+public:
+	log_reader(const char* data, size_t size): ptr(data), end(data+size) {}
+	bool at_end() const {
+		return ptr == end;
+	}
+	// the count of bytes not read yet
+	size_t left() const {
+		return end - ptr;
+	}
+	bool read_bytes(char* out, size_t size) {
+		if(size_t(end - ptr) < size) return false;
+		memcpy(out, ptr, size);
+		ptr += size;
+		return true;
+	}
+	bool read_u32(uint32_t* i) {
+		uint32_or_b4 data;
+		if(!read_bytes(data.b4, 4)) return false;
+		*i = data.u32;
+		return true;
+	}
+	bool read_u64(uint64_t* i) {
+		uint64_or_b8 data;
+		if(!read_bytes(data.b8, 8)) return false;
+		*i = data.u64;
+		return true;
+	}
+	bool read_i64(int64_t* i) {
+		int64_or_b8 data;
+		if(!read_bytes(data.b8, 8)) return false;
+		*i = data.i64;
+		return true;
+	}
+	bool read_str(std::string* s) {
+		uint32_t size;
+		if(!read_u32(&size)) return false;
+		return read_str_of_size(s, size);
+	}
+	bool read_str_of_size(std::string* s, uint64_t size) {
+		if(uint64_t(end - ptr) < size) return false;
+		s->assign(ptr, size);
+		ptr += size;
+		return true;
+	}
+	// read an unsigned LEB128 varint
+	bool read_varint(uint64_t* i) {
+		uint64_t res = 0;
+		for(int shift = 0; shift < 64 && ptr != end; shift += 7) {
+			uint8_t b = uint8_t(*ptr++);
+			res |= uint64_t(b & 0x7F) << shift;
+			if((b & 0x80) == 0) {
+				*i = res;
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
 // In-memory data structure with on-disk logs
+// The log entries are accumulated in 'log_buf' as one frame, whose payload begins with the
+// 'log_encoding' byte. The frame which is sealed and written to the
+// log file by 'flush_log'. Alternatively, the sealed frame can be taken out by 'take_log_bytes'
+// and written by 'write_log_bytes' in another thread, while new entries are being added to a new
+// frame in 'log_buf'.
 class ds_with_log {
 protected:
 	std::string log_dir;
 	std::string curr_log_fname;
-	std::ofstream curr_log;
+	int         log_fd;
+	sync_policy log_sync;
+	int         log_encoding; // the encoding of the log entries, chosen by subclass
+	std::string log_buf; // the current frame, which is not written to the log file yet
+	size_t      log_size; // the size of the log file, including the bytes which are not written yet
 
+	void log_bytes(const char* data, size_t size) {
+		if(log_buf.empty()) { // reserve space for the header of a new frame
+			log_buf.append(FRAME_HEADER_SIZE, char(0));
+			log_buf.push_back(char(log_encoding));
+			log_size += FRAME_HEADER_SIZE + 1;
+		}
+		log_buf.append(data, size);
+		log_size += size;
+	}
 	void log_u32(uint32_t i) {
 		uint32_or_b4 data;
 		data.u32 = i;
-		curr_log.write(data.b4, 4);
+		log_bytes(data.b4, 4);
 	}
 	void log_u64(uint64_t i) {
 		uint64_or_b8 data;
 		data.u64 = i;
-		curr_log.write(data.b8, 8);
+		log_bytes(data.b8, 8);
 	}
 	void log_i64(int64_t i) {
 		int64_or_b8 data;
 		data.i64 = i;
-		curr_log.write(data.b8, 8);
+		log_bytes(data.b8, 8);
 	}
 	void log_str(const std::string& s) {
 		log_u32(s.size());
-		curr_log.write(s.c_str(), s.size());
+		log_bytes(s.data(), s.size());
 	}
-	static std::ios::iostate read_u32(std::ifstream& fin, uint32_t* i) {
-		uint32_or_b4 data;
-		fin.read(data.b4, 4);
-		*i = data.u32;
-		return fin.rdstate();
+	// log an unsigned LEB128 varint
+	void log_varint(uint64_t i) {
+		char buf[10];
+		int n = 0;
+		for(; i >= 0x80; i >>= 7) {
+			buf[n++] = char(i | 0x80);
+		}
+		buf[n++] = char(i);
+		log_bytes(buf, n);
 	}
-	static std::ios::iostate read_u64(std::ifstream& fin, uint64_t* i) {
-		uint64_or_b8 data;
-		fin.read(data.b8, 8);
-		*i = data.u64;
-		return fin.rdstate();
+	// whether the next log entry will begin a new frame
+	bool frame_is_empty() {
+		return log_buf.empty();
 	}
-	static std::ios::iostate read_i64(std::ifstream& fin, int64_t* i) {
-		int64_or_b8 data;
-		fin.read(data.b8, 8);
-		*i = data.i64;
-		return fin.rdstate();
+	// fill the header of the frame in 'log_buf'
+	void seal_frame() {
+		if(log_buf.empty()) return;
+		uint32_or_b4 len, crc;
+		len.u32 = log_buf.size() - FRAME_HEADER_SIZE;
+		crc.u32 = crc32c::value(log_buf.data() + FRAME_HEADER_SIZE, len.u32);
+		memcpy(&log_buf[0], len.b4, 4);
+		memcpy(&log_buf[4], crc.b4, 4);
 	}
-	static std::ios::iostate read_str(std::ifstream& fin, std::string* s) {
-		uint32_t size;
-		read_u32(fin, &size);
-		std::vector<char> vec(size_t(size), char(0));
-		fin.read(vec.data(), vec.size());
-		*s = std::string(vec.data(), vec.size());
-		return fin.rdstate();
+	// The size of the whole entries at the beginning of 'data', which uses LOG_ENCODING_RAW. A
+	// log file in the oldest format has no frames to tell where a torn write begins, so the
+	// subclass, which knows the layout of its entries, finds it.
+	virtual size_t raw_entries_size(const char* /*data*/, size_t size) {
+		return size;
+	}
+	// The same as 'read_log_file', and besides, a torn entry at the end of a log file in the
+	// oldest format is cut off.
+	bool read_log_frames(const std::string& fname, mapped_file* content,
+		std::vector<log_frame>* frames, bool cut_torn_tail) {
+		if(!read_log_file(fname, content, frames, cut_torn_tail)) {
+			return false;
+		}
+		if(!is_unframed_log(*content) || frames->empty()) return true;
+		auto& frame = frames->at(0);
+		size_t size = raw_entries_size(frame.data, frame.size);
+		if(size == frame.size) return true;
+		std::cerr<<"Torn log found in "<<fname<<" at "<<size<<std::endl;
+		frame.size = size;
+		if(cut_torn_tail && truncate(fname.c_str(), size) != 0) {
+			std::cerr<<"Failed to truncate "<<fname<<std::endl;
+			return false;
+		}
+		return true;
+	}
+	// New frames cannot be appended to a log file of older formats, so its content is re-written
+	// into frames of the current format, whose encoding bytes are LOG_ENCODING_RAW. A torn entry
+	// at the end of the file is dropped, otherwise it would corrupt the frame containing it.
+	bool upgrade_log_file() {
+		mapped_file content;
+		std::vector<log_frame> frames;
+		if(!read_log_frames(curr_log_fname, &content, &frames, false)) {
+			return false;
+		}
+		std::string out(LOG_FILE_MAGIC, LOG_FILE_HEADER_SIZE);
+		for(auto& frame : frames) {
+			uint32_or_b4 len, crc;
+			len.u32 = frame.size + 1;
+			char enc = char(frame.encoding);
+			crc.u32 = crc32c::extend(crc32c::value(&enc, 1), frame.data, frame.size);
+			out.append(len.b4, 4);
+			out.append(crc.b4, 4);
+			out.push_back(enc);
+			out.append(frame.data, frame.size);
+		}
+		auto tmp_fname = curr_log_fname+".new";
+		int fd = open(tmp_fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0 || !write_all(fd, out.data(), out.size()) || fdatasync(fd) != 0) {
+			std::cerr<<"Failed to write log file: "<<tmp_fname<<std::endl;
+			if(fd >= 0) close(fd);
+			return false;
+		}
+		close(fd);
+		return rename(tmp_fname.c_str(), curr_log_fname.c_str()) == 0;
+	}
+	bool open_log_file(int flags) {
+		if((flags & O_TRUNC) == 0 && !is_current_format()) {
+			if(!upgrade_log_file()) {
+				std::cerr<<"Failed to upgrade log file: "<<curr_log_fname<<std::endl;
+				return false;
+			}
+		}
+		log_fd = open(curr_log_fname.c_str(), O_WRONLY | O_CREAT | O_APPEND | flags, 0644);
+		if(log_fd < 0) {
+			std::cerr<<"Failed to open log file: "<<curr_log_fname<<std::endl;
+			return false;
+		}
+		log_size = lseek(log_fd, 0, SEEK_END);
+		if(log_size == 0) {
+			if(!write_all(log_fd, LOG_FILE_MAGIC, LOG_FILE_HEADER_SIZE)) {
+				std::cerr<<"Failed to write log file: "<<curr_log_fname<<std::endl;
+				return false;
+			}
+			log_size = LOG_FILE_HEADER_SIZE;
+		}
+		return true;
+	}
+	// whether the current log file is missing, empty or begins with LOG_FILE_MAGIC
+	bool is_current_format() {
+		int fd = open(curr_log_fname.c_str(), O_RDONLY);
+		if(fd < 0) return true;
+		char magic[LOG_FILE_HEADER_SIZE];
+		auto n = read(fd, magic, LOG_FILE_HEADER_SIZE);
+		close(fd);
+		return n == 0 || (n == LOG_FILE_HEADER_SIZE && memcmp(magic, LOG_FILE_MAGIC, n) == 0);
 	}
 public:
+	ds_with_log(): log_fd(-1), log_sync(SYNC_NONE), log_encoding(LOG_ENCODING_RAW), log_size(0) {}
+	virtual ~ds_with_log() {
+		if(log_fd >= 0) {
+			flush_log();
+			close(log_fd);
+		}
+	}
+
 	void set_log_dir(const std::string& dir) {
 		log_dir = dir;
 	}
+	void set_sync_policy(sync_policy policy) {
+		log_sync = policy;
+	}
 	bool open_log(int num) {
 		curr_log_fname = log_dir+"/"+std::to_string(num);
-		if(curr_log.is_open()) {
+		if(log_fd >= 0) {
 			std::cerr<<"The log file is already opened."<<std::endl;
 			return false;
 		}
-		curr_log.open(curr_log_fname.c_str(), std::ios::out | std::ios::app | std::ios::binary);
-		if(!curr_log.is_open()) {
-			std::cerr<<"Failed to open log file: "<<curr_log_fname<<std::endl;
+		return open_log_file(0);
+	}
+	bool flush_log() {
+		seal_frame();
+		bool ok = write_log_bytes(log_buf);
+		log_buf.clear();
+		return ok;
+	}
+	// Seal the current frame and move it out to 'out'
+	void take_log_bytes(std::string* out) {
+		seal_frame();
+		out->clear();
+		out->swap(log_buf);
+	}
+	// Write the bytes taken by 'take_log_bytes' to the log file. It only accesses the log file,
+	// so it can run concurrently with the functions adding new log entries.
+	bool write_log_bytes(const std::string& bytes) {
+		if(bytes.empty()) return true;
+		if(!write_all(log_fd, bytes.data(), bytes.size())) {
+			std::cerr<<"Failed to write log file: "<<curr_log_fname<<std::endl;
 			return false;
 		}
+		if(log_sync == SYNC_EACH_WRITE) {
+			return sync_log();
+		}
 		return true;
 	}
-	void flush_log() {
-		curr_log.flush();
+	// Make the written log bytes durable
+	bool sync_log() {
+		if(fdatasync(log_fd) != 0) {
+			std::cerr<<"Failed to sync log file: "<<curr_log_fname<<std::endl;
+			return false;
+		}
+		return true;
 	}
 	size_t log_file_size() {
-		return curr_log.tellp();
+		return log_size;
 	}
-	void close_log(int num) {
-		curr_log.close();
+	void close_log(int /*num*/) {
+		flush_log();
+		close(log_fd);
+		log_fd = -1;
 	}
 	void remove_log() {
 		remove_file(curr_log_fname);
 	}
 	bool switch_log(int num) {
-		curr_log.close();
+		flush_log();
+		close(log_fd);
 		curr_log_fname = log_dir+"/"+std::to_string(num);
-		curr_log.open(curr_log_fname.c_str(), std::ios::trunc | std::ios::app | std::ios::binary);
-		if(!curr_log.is_open()) {
-			std::cerr<<"Failed to open log file: "<<curr_log_fname<<std::endl;
-			return false;
-		}
-		return true;
+		return open_log_file(O_TRUNC);
 	}
 };
 
@@ -34,34 +34,166 @@ public:
 		uint64_t hashkey = hashstr(key, meta.seed);
 		return ikv.lookup(hashkey, key, out);
 	}
+	// Call it at shutdown to remember the hottest keys for warming up the cache after restart
+	bool save_hot_keys(size_t count) {
+		return ikv.save_hot_keys(count);
+	}
+	// Pre-load the cache with the keys saved at last shutdown, at most 'keys_per_sec' per second
+	bool start_warm_up(size_t keys_per_sec) {
+		return ikv.start_warm_up(keys_per_sec);
+	}
+	// The short hash of 'key', by which the pairs given to 'ingest' must be sorted
+	uint64_t hash_key(const std::string& key) {
+		return hashstr(key, meta.seed);
+	}
+	// See 'internalkv::ingest'. The 'key' field of each pair must be 'hash_key(value.kstr)'.
+	int64_t ingest(kv_producer* prod) {
+		return ikv.ingest(prod);
+	}
+	// See 'internalkv::start_compaction'
+	void start_compaction(const compaction_policy& policy) {
+		ikv.start_compaction(policy);
+	}
+	// See 'internalkv::resume_compaction'
+	void resume_compaction(const compaction_policy& policy) {
+		ikv.resume_compaction(policy);
+	}
+	// See 'internalkv::set_compaction_rate'
+	void set_compaction_rate(int64_t bytes_per_sec) {
+		ikv.set_compaction_rate(bytes_per_sec);
+	}
+	// See 'internalkv::set_compaction_auto_tune'
+	void set_compaction_auto_tune(int64_t min_bytes_per_sec, int64_t max_bytes_per_sec, int64_t target_us) {
+		ikv.set_compaction_auto_tune(min_bytes_per_sec, max_bytes_per_sec, target_us);
+	}
+	// See 'internalkv::get_compaction_stats'
+	void get_compaction_stats(compaction_stats* out) {
+		ikv.get_compaction_stats(out);
+	}
+	// See 'internalkv::set_compaction_event_log'
+	bool set_compaction_event_log(const std::string& fname) {
+		return ikv.set_compaction_event_log(fname);
+	}
+	// See 'internalkv::set_durability'
+	void set_durability(sync_policy mode, int64_t window_ms, size_t window_bytes) {
+		ikv.set_durability(mode, window_ms, window_bytes);
+	}
+	// Block until the batch whose commit_result has 'seq' is durable. Returns false if its logs
+	// failed to be written or synced, or no batch has 'seq' yet.
+	bool wait_durable(int64_t seq) {
+		return ikv.wait_durable(seq);
+	}
 };
 
+// A batch of writes to be committed together. The bytes of keys and values are appended to an
+// arena, and the entries are deduplicated with a flat hash table using open addressing. Both of
+// them keep their capacity after commit, so building batches allocates no memory in steady state.
+// The entries are sorted by key only once, when the batch is committed.
 class moeingkv_batch {
-	moeingkv* parent;
-	btree::btree_multimap<uint64_t, dstr_with_id> new_map;
+	enum {
+		MIN_TABLE_SIZE = 64, // must be a power of two
+	};
+	// the pending writes of a key: delete its old value and/or insert a new value
+	struct entry {
+		uint64_t hashkey;
+		size_t   key_off;
+		size_t   key_len;
+		size_t   value_off;
+		size_t   value_len;
+		bool     has_del;
+		bool     has_ins;
+	};
+	moeingkv*          parent;
+	std::string        arena;
+	std::vector<entry> entries;
+	std::vector<int>   table; // indexes of 'entries', -1 for an empty slot
+	batch_map          new_map;
+
+	// find the slot for 'key' in 'table', which is either empty or occupied by 'key'
+	size_t find_slot(uint64_t hashkey, const std::string& key) const {
+		size_t mask = table.size() - 1;
+		for(size_t i = hashkey & mask; ; i = (i + 1) & mask) {
+			int idx = table[i];
+			if(idx < 0) return i;
+			auto& e = entries[idx];
+			if(e.hashkey == hashkey && e.key_len == key.size() &&
+			   memcmp(arena.data() + e.key_off, key.data(), key.size()) == 0) {
+				return i;
+			}
+		}
+	}
+	// double the size of 'table' and re-insert all the entries
+	void grow_table() {
+		table.assign(table.size() * 2, -1);
+		size_t mask = table.size() - 1;
+		for(int idx = 0; idx < int(entries.size()); idx++) {
+			size_t i = entries[idx].hashkey & mask;
+			while(table[i] >= 0) {
+				i = (i + 1) & mask;
+			}
+			table[i] = idx;
+		}
+	}
+	void clear() {
+		arena.clear();
+		entries.clear();
+		std::fill(table.begin(), table.end(), -1);
+	}
 public:
+	moeingkv_batch(moeingkv* parent): parent(parent), table(MIN_TABLE_SIZE, -1) {}
+	moeingkv_batch(const moeingkv_batch& other) = delete;
+	moeingkv_batch& operator=(const moeingkv_batch& other) = delete;
+	moeingkv_batch(moeingkv_batch&& other) = delete;
+	moeingkv_batch& operator=(moeingkv_batch&& other) = delete;
+
+	// Record a write of 'key'. It has the same effect as writing them one after another: a later
+	// insertion overwrites an earlier one, while a later deletion cancels the earlier insertion.
 	void modify(const std::string& key, const std::string& value, bool is_del) {
 		uint64_t hashkey = hashstr(key, parent->meta.seed);
-		auto pos = new_map.end();
-		for(auto iter = new_map.find(hashkey); iter != new_map.end(); iter++) {
-			if(iter->second.dstr.kstr == key) {
-				pos = iter;
-				break;
+		size_t slot = find_slot(hashkey, key);
+		if(table[slot] < 0) {
+			if((entries.size() + 1) * 2 > table.size()) { // keep the load factor under 0.5
+				grow_table();
+				slot = find_slot(hashkey, key);
 			}
+			table[slot] = entries.size();
+			entries.push_back(entry{.hashkey=hashkey, .key_off=arena.size(), .key_len=key.size(),
+				.value_off=0, .value_len=0, .has_del=false, .has_ins=false});
+			arena.append(key);
 		}
-		if(pos != new_map.end()) { //has a just-inserted entry
-			if(is_del) {
-				new_map.erase(pos);
-			} else {
-				pos->second.dstr.vstr = value;
-			}
+		auto& e = entries[table[slot]];
+		if(is_del) {
+			e.has_del = true;
+			e.has_ins = false;
 		} else {
-			auto v = dstr_with_id{.id=1};
-			v.dstr.kstr = key;
-			v.dstr.vstr = key;
-			if(is_del) v.id = -1;
-			new_map.insert(std::make_pair(hashkey, v));
+			e.has_ins = true;
+			e.value_off = arena.size();
+			e.value_len = value.size();
+			arena.append(value);
+		}
+	}
+	// Write this batch into the database, it can be called by many threads concurrently and the
+	// concurrent batches are committed as a group. The batch is empty afterwards.
+	commit_result commit() {
+		std::sort(entries.begin(), entries.end(), [](const entry& a, const entry& b) {
+			return a.hashkey < b.hashkey;
+		});
+		for(auto& e : entries) { // sorted input is appended at the end of btree
+			auto v = dstr_with_id{.dstr={}, .id=-1};
+			v.dstr.kstr.assign(arena.data() + e.key_off, e.key_len);
+			if(e.has_del) {
+				new_map.insert(new_map.end(), std::make_pair(e.hashkey, v));
+			}
+			if(e.has_ins) { // placed after the deletion of the same key
+				v.id = 1;
+				v.dstr.vstr.assign(arena.data() + e.value_off, e.value_len);
+				new_map.insert(new_map.end(), std::make_pair(e.hashkey, v));
+			}
 		}
+		clear();
+		auto res = parent->ikv.commit(&new_map);
+		new_map.clear();
+		return res;
 	}
 };
 
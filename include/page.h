@@ -5,20 +5,48 @@
 #include <string.h>
 #include <unistd.h>
 #include <algorithm>
+#include <future>
+#include <memory>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <iostream>
 #include "bloomfilter.h"
 #include "bitarray.h"
 #include "u64vec.h"
+#include "rate_limiter.h"
 
 namespace moeingkv {
 
 enum __page_size_t {
 	PAGE_SIZE = 4096,
 	PAGE_INIT_SIZE = 8,
+	PAGE_VERSION_POS = 2, // the byte recording the format of a page, which is zero in v1 pages
+	PAGE_VERSION_2 = 2,
+	PAGE_V2_HEADER_SIZE = 24,
 };
 
 // Raw memory of PAGE_SIZE bytes, which can be loaded from or stored to SSD directly. 
+// There are two formats, and both of them begin with a 2-byte count of kv pairs.
+// v1: the count, 6 zero bytes, the 8-byte keys, the 2-byte offsets of the entries and then the
+//     entries. Each entry has an 8-byte id, two 2-byte lengths and the two strings.
+// v2: a 24-byte header, the common prefix of all the key strings, the key suffixes, the 2-byte
+//     offsets of the entries (aligned to 2 bytes) and then the entries. The header has the count, the version byte,
+//     the byte width of the key suffixes, the length of the prefix, a base key and a base id.
+//     The keys are sorted, so they share the high bits of the base key and only their low
+//     bytes are stored as key suffixes. Each entry has the varints of the id minus base id, the
+//     length of the key string without the prefix and the length of the value string, and then
+//     the two strings without the prefix.
+// The pages are written in v2, and the v1 pages in old vaults stay readable.
 class page {
 	std::array<char, PAGE_SIZE> arr;
+	// the fields of an entry in a v2 page
+	struct entry_v2 {
+		int64_t id;
+		size_t  klen; // without the prefix
+		size_t  vlen;
+		size_t  kpos; // where the key string without the prefix begins, followed by the value
+	};
 	void write_u16(size_t offset, uint16_t v) {
 		uint16_t* u16ptr = reinterpret_cast<uint16_t*>(arr.data()+offset);
 		*u16ptr = v;
@@ -49,6 +77,116 @@ class page {
 	void read_str(size_t offset, std::string* s, size_t size) {
 		*s = std::string(arr.data()+offset, size);
 	}
+	void write_varint(size_t* offset, uint64_t v) {
+		for(; v >= 0x80; v >>= 7) {
+			arr[(*offset)++] = char(v | 0x80);
+		}
+		arr[(*offset)++] = char(v);
+	}
+	uint64_t read_varint(size_t* offset) {
+		uint64_t res = 0;
+		for(int shift = 0; *offset < PAGE_SIZE && shift < 64; shift += 7) {
+			uint8_t b = uint8_t(arr[(*offset)++]);
+			res |= uint64_t(b & 0x7F) << shift;
+			if((b & 0x80) == 0) break;
+		}
+		return res;
+	}
+	bool is_v2() {
+		return uint8_t(arr[PAGE_VERSION_POS]) == PAGE_VERSION_2;
+	}
+	size_t key_bytes_v2() {
+		return uint8_t(arr[3]);
+	}
+	size_t prefix_len_v2() {
+		return read_u16(4);
+	}
+	// the mask of the low bits stored as key suffixes
+	static uint64_t suffix_mask(size_t key_bytes) {
+		return key_bytes >= 8 ? ~uint64_t(0) : (uint64_t(1) << (8 * key_bytes)) - 1;
+	}
+	uint64_t key_at_v2(size_t idx) {
+		size_t key_bytes = key_bytes_v2();
+		uint64_t suffix = 0;
+		memcpy(&suffix, arr.data() + PAGE_V2_HEADER_SIZE + prefix_len_v2() + key_bytes * idx, key_bytes);
+		return (read_u64(8) & ~suffix_mask(key_bytes)) | suffix;
+	}
+	// where the offsets of the entries begin in a v2 page, aligned to 2 bytes
+	static size_t offsets_pos_v2(size_t prefix_len, size_t key_bytes, size_t count) {
+		return (PAGE_V2_HEADER_SIZE + prefix_len + key_bytes * count + 1) & ~size_t(1);
+	}
+	void read_entry_v2(size_t idx, entry_v2* e) {
+		size_t count = read_u16(0);
+		size_t pos = read_u16(offsets_pos_v2(prefix_len_v2(), key_bytes_v2(), count) + 2 * idx);
+		e->id = read_i64(16) + int64_t(read_varint(&pos));
+		e->klen = read_varint(&pos);
+		e->vlen = read_varint(&pos);
+		e->kpos = pos;
+	}
+	// the id of the pair at 'idx'
+	int64_t id_at(size_t idx) {
+		if(is_v2()) {
+			entry_v2 e;
+			read_entry_v2(idx, &e);
+			return e.id;
+		}
+		return read_i64(read_u16(PAGE_INIT_SIZE + 8 * read_u16(0) + 2 * idx));
+	}
+	bool lookup_v2(uint64_t key, const std::string& key_str, str_with_id* out, bitarray* del_mark) {
+		size_t count = read_u16(0);
+		uint64_t mask = suffix_mask(key_bytes_v2());
+		if(count == 0 || (key & ~mask) != (read_u64(8) & ~mask)) {
+			return false;
+		}
+		size_t lo = 0, hi = count; // binary search for the first key not smaller than 'key'
+		while(lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if(key_at_v2(mid) < key) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		size_t prefix_len = prefix_len_v2();
+		const char* prefix = arr.data() + PAGE_V2_HEADER_SIZE;
+		for(size_t idx = lo; idx < count && key_at_v2(idx) == key; idx++) {
+			entry_v2 e;
+			read_entry_v2(idx, &e);
+			if(prefix_len + e.klen != key_str.size() ||
+			   memcmp(prefix, key_str.data(), prefix_len) != 0 ||
+			   memcmp(arr.data() + e.kpos, key_str.data() + prefix_len, e.klen) != 0) {
+				continue;
+			}
+			if(!del_mark->get(e.id)) {
+				out->str = std::string(arr.data() + e.kpos + e.klen, e.vlen);
+				out->id = e.id;
+				return true;
+			}
+		}
+		return false;
+	}
+	size_t extract_v2_to(std::vector<kv_pair>* vec, bitarray* del_mark) {
+		size_t skipped = 0;
+		size_t count = read_u16(0);
+		std::string prefix(arr.data() + PAGE_V2_HEADER_SIZE, prefix_len_v2());
+		for(size_t idx = 0; idx < count; idx++) {
+			entry_v2 e;
+			read_entry_v2(idx, &e);
+			if(del_mark->get(e.id)) {
+				skipped++;
+				continue;
+			}
+			kv_pair kv;
+			kv.id = e.id;
+			kv.key = key_at_v2(idx);
+			kv.value.kstr.reserve(prefix.size() + e.klen);
+			kv.value.kstr.append(prefix);
+			kv.value.kstr.append(arr.data() + e.kpos, e.klen);
+			kv.value.vstr = std::string(arr.data() + e.kpos + e.klen, e.vlen);
+			vec->push_back(std::move(kv));
+		}
+		return skipped;
+	}
 public:
 	page(): arr() {}
 	page(const page& other) = delete;
@@ -59,30 +197,86 @@ public:
 	char* data() {
 		return arr.data();
 	}
-	// fill the raw bytes with content in 'in_list'
+	size_t pair_count() {
+		return read_u16(0);
+	}
+	uint64_t key_at(size_t idx) {
+		if(is_v2()) return key_at_v2(idx);
+		return read_u64(PAGE_INIT_SIZE + 8 * idx);
+	}
+	static size_t varint_size(uint64_t v) {
+		size_t n = 1;
+		for(; v >= 0x80; v >>= 7) n++;
+		return n;
+	}
+	// the smallest id of the kv pairs stored in current page
+	int64_t min_id() {
+		size_t count = read_u16(0);
+		if(is_v2()) { // the base id is the smallest one
+			return count == 0 ? INT64_MAX : read_i64(16);
+		}
+		int64_t res = INT64_MAX;
+		for(size_t idx = 0; idx < count; idx++) {
+			res = std::min(res, id_at(idx));
+		}
+		return res;
+	}
+	// Returns whether some of the kv pairs stored in current page are marked as deleted in 'del_mark'
+	bool has_deleted(bitarray* del_mark) {
+		size_t count = read_u16(0);
+		for(size_t idx = 0; idx < count; idx++) {
+			if(del_mark->get(id_at(idx))) {
+				return true;
+			}
+		}
+		return false;
+	}
+	// Fill the raw bytes in v2 with content in 'in_list', which is sorted by keys and must fit in
+	// the page according to 'kv_packer'
 	void fill_with(const std::vector<kv_pair>& in_list) {
-		size_t start = PAGE_INIT_SIZE;
-		for(auto iter=in_list.begin(); iter != in_list.end(); iter++) {
-			write_u64(start, iter->key); start += 8;
+		size_t count = in_list.size();
+		uint64_t diff = in_list.front().key ^ in_list.back().key;
+		size_t key_bytes = diff == 0 ? 0 : (64 - __builtin_clzll(diff) + 7) / 8;
+		const std::string& first_kstr = in_list.front().value.kstr;
+		size_t prefix_len = first_kstr.size();
+		int64_t base_id = INT64_MAX;
+		for(auto& kv : in_list) {
+			size_t n = 0;
+			while(n < prefix_len && n < kv.value.kstr.size() && kv.value.kstr[n] == first_kstr[n]) n++;
+			prefix_len = n;
+			base_id = std::min(base_id, kv.id);
 		}
-		uint16_t offset = start + 2 * in_list.size();
-		for(auto iter=in_list.begin(); iter != in_list.end(); iter++) {
-			write_u16(start, offset); start+=2;
-			offset += 8/*id*/ + 4/*two lengths*/ +
-				iter->value.kstr.size() + iter->value.vstr.size();
+		write_u16(0, uint16_t(count));
+		arr[PAGE_VERSION_POS] = char(PAGE_VERSION_2);
+		arr[3] = char(key_bytes);
+		write_u16(4, uint16_t(prefix_len));
+		write_u16(6, 0);
+		write_u64(8, in_list.front().key);
+		write_i64(16, base_id);
+		size_t start = PAGE_V2_HEADER_SIZE;
+		memcpy(arr.data() + start, first_kstr.data(), prefix_len); start += prefix_len;
+		for(auto& kv : in_list) {
+			memcpy(arr.data() + start, &kv.key, key_bytes); start += key_bytes;
 		}
-		for(auto iter=in_list.begin(); iter != in_list.end(); iter++) {
-			write_i64(start, iter->id); start += 8;
-			write_u16(start, uint16_t(iter->value.kstr.size())); start += 2;
-			write_u16(start, uint16_t(iter->value.vstr.size())); start += 2;
-			write_str(start, iter->value.kstr); start += iter->value.kstr.size();
-			write_str(start, iter->value.vstr); start += iter->value.vstr.size();
+		size_t offset_start = offsets_pos_v2(prefix_len, key_bytes, count);
+		start = offset_start + 2 * count;
+		for(size_t idx = 0; idx < count; idx++) {
+			auto& kv = in_list[idx];
+			write_u16(offset_start + 2 * idx, uint16_t(start));
+			size_t klen = kv.value.kstr.size() - prefix_len;
+			write_varint(&start, uint64_t(kv.id - base_id));
+			write_varint(&start, klen);
+			write_varint(&start, kv.value.vstr.size());
+			memcpy(arr.data() + start, kv.value.kstr.data() + prefix_len, klen); start += klen;
+			write_str(start, kv.value.vstr); start += kv.value.vstr.size();
 		}
+		assert(start <= PAGE_SIZE);
 	}
 	// Look up the corresponding 'str_with_id' for 'key_str'. 'key' must be short hash of 'key_str'
 	// and its id must have not been marked as deleted in 'del_mark'. 
 	// Returns whether a valid 'out' is found.
 	bool lookup(uint64_t key, const std::string& key_str, str_with_id* out, bitarray* del_mark) {
+		if(is_v2()) return lookup_v2(key, key_str, out, del_mark);
 		size_t count = read_u16(0);
 		uint64_t* keyptr_start = reinterpret_cast<uint64_t*>(arr.data()+PAGE_INIT_SIZE);
 		uint64_t* keyptr_end = keyptr_start + count;
@@ -109,9 +303,12 @@ public:
 		}
 		return false;
 	}
-	// Extract the kv pairs stored in current page out, except the ones marked as deleted in 'del_mark'
-	void extract_to(std::vector<kv_pair>* vec, bitarray* del_mark) {
+	// Extract the kv pairs stored in current page out, except the ones marked as deleted in 'del_mark'.
+	// Returns how many pairs are skipped for being deleted.
+	size_t extract_to(std::vector<kv_pair>* vec, bitarray* del_mark) {
 		vec->clear();
+		if(is_v2()) return extract_v2_to(vec, del_mark);
+		size_t skipped = 0;
 		size_t count = read_u16(0);
 		uint64_t* keyptr_start = reinterpret_cast<uint64_t*>(arr.data()+PAGE_INIT_SIZE);
 		for(size_t idx = 0; idx < count; idx++) {
@@ -120,6 +317,7 @@ public:
 			kv_pair kv;
 			kv.id = read_i64(pos);
 			if(del_mark->get(kv.id)) {
+				skipped++;
 				continue;
 			}
 			size_t first_value_len = read_u16(pos + 8);
@@ -131,6 +329,7 @@ public:
 			kv.value.vstr = std::string(second_value_start, second_value_len);
 			vec->push_back(kv);
 		}
+		return skipped;
 	}
 };
 
@@ -140,6 +339,10 @@ public:
 	virtual kv_pair peek() = 0;
 	virtual kv_pair produce() = 0;
 	virtual bool valid() = 0;
+	// the key of the next kv_pair, which can be overridden to avoid copying the strings
+	virtual uint64_t peek_key() {
+		return peek().key;
+	}
 };
 
 // ============================
@@ -192,83 +395,451 @@ public:
 	}
 };
 
-// It reads kv_pairs from the pages in a vault
+// It merges kv_pair streams from any number of kv_producers into one stream, while keeping keys'
+// increasing order. The producers are kept in a min-heap by their next keys, and for the same key,
+// the producer added earlier comes first.
+class multi_merged_kv_producer : public kv_producer {
+	typedef std::pair<uint64_t, int> heap_item; // (next key, index of producer)
+	std::vector<kv_producer*> prods;
+	std::vector<heap_item>    heap;
+	static bool greater(const heap_item& a, const heap_item& b) {
+		return a > b;
+	}
+public:
+	multi_merged_kv_producer(const std::vector<kv_producer*>& prods): prods(prods) {
+		for(int i=0; i<int(prods.size()); i++) {
+			if(prods[i]->valid()) {
+				heap.push_back(heap_item(prods[i]->peek_key(), i));
+			}
+		}
+		std::make_heap(heap.begin(), heap.end(), greater);
+	}
+	multi_merged_kv_producer(const multi_merged_kv_producer& other) = delete;
+	multi_merged_kv_producer& operator=(const multi_merged_kv_producer& other) = delete;
+	multi_merged_kv_producer(multi_merged_kv_producer&& other) = delete;
+	multi_merged_kv_producer& operator=(multi_merged_kv_producer&& other) = delete;
+
+	kv_pair peek() {
+		return prods[heap[0].second]->peek();
+	}
+	uint64_t peek_key() {
+		return heap[0].first;
+	}
+	kv_pair produce() {
+		if(!valid()) return kv_pair{};
+		auto res = prods[heap[0].second]->produce();
+		update_top();
+		return res;
+	}
+	bool valid() {
+		return !heap.empty();
+	}
+	// the index of the producer which has the next kv_pair
+	int top() {
+		return heap[0].second;
+	}
+	// Returns whether the producers other than 'top()' have no keys smaller than or equal to 'key'
+	bool others_after(uint64_t key) {
+		for(size_t i = 1; i < 3 && i < heap.size(); i++) { // the children of the top have the smallest keys
+			if(heap[i].first <= key) return false;
+		}
+		return true;
+	}
+	// re-position the top producer after it has been advanced by the caller directly
+	void update_top() {
+		std::pop_heap(heap.begin(), heap.end(), greater);
+		int idx = heap.back().second;
+		heap.pop_back();
+		if(prods[idx]->valid()) {
+			heap.push_back(heap_item(prods[idx]->peek_key(), idx));
+			std::push_heap(heap.begin(), heap.end(), greater);
+		}
+	}
+};
+
+// It reads kv_pairs from the pages in a vault. The pages are read in chunks of READ_CHUNK_SIZE
+// bytes with two buffers: while the pages in one chunk are being decoded, the next chunk is
+// loaded into the other buffer in background.
+// A page none of whose pairs are deleted is not decoded until its pairs are peeked, so the
+// caller can take it with 'clean_page' and 'skip_page' and copy it as a whole.
 class kv_reader : public kv_producer {
+	enum {
+		READ_CHUNK_SIZE = 2*1024*1024, // must be a multiple of PAGE_SIZE
+	};
 	int fd; // file descriptor of the vault
 	size_t offset; // start position for reading
 	size_t end_offset; // end position for reading
+	size_t read_offset; // start position of the chunks which are not loaded yet
 	std::vector<kv_pair> pairs;
 	int pair_idx;
 	bitarray* del_mark;
+	rate_limiter* limiter; // throttles the reads, or null for unthrottled
+	page curr_page; // the page loaded last
+	bool page_is_clean; // 'curr_page' is not decoded yet and none of its pairs are deleted
+	uint64_t loaded_pages;
+	uint64_t dropped_pairs; // the deleted pairs skipped
+	bool read_failed; // a chunk could not be read, so the pairs after it are missing
+	std::unique_ptr<char[]> curr_buf; // the chunk being decoded
+	size_t curr_size;
+	size_t curr_pos;
+	std::unique_ptr<char[]> next_buf;
+	std::future<size_t> next_chunk; // loads 'next_buf', and returns the loaded size or 0 on failure
+	// start loading the next chunk into 'next_buf'
+	void prefetch() {
+		if(read_offset >= end_offset) return;
+		size_t size = std::min(size_t(READ_CHUNK_SIZE), end_offset - read_offset);
+		char* buf = next_buf.get();
+		size_t start = read_offset;
+		read_offset += size;
+		next_chunk = std::async(std::launch::async, [this, buf, start, size]() {
+			if(this->limiter != nullptr) this->limiter->request(size);
+			size_t done = 0;
+			while(done < size) {
+				auto sz = pread(this->fd, buf + done, size - done, start + done);
+				if(sz < 0 && errno == EINTR) continue;
+				if(sz <= 0) {
+					std::cerr<<"Failed to read vault file at "<<start + done<<std::endl;
+					return size_t(0);
+				}
+				done += sz;
+			}
+			return done;
+		});
+	}
 	void load_page() {
-		page pg;
-		auto sz = pread(fd, pg.data(), PAGE_SIZE, offset);
-		assert(sz == PAGE_SIZE);
+		if(curr_pos == curr_size) { // switch to the next chunk
+			curr_size = next_chunk.get();
+			std::swap(curr_buf, next_buf);
+			curr_pos = 0;
+			prefetch();
+		}
+		if(curr_pos + PAGE_SIZE > curr_size) { // nothing after it can be decoded
+			read_failed = true;
+			offset = end_offset;
+			pairs.clear();
+			pair_idx = 0;
+			return;
+		}
+		memcpy(curr_page.data(), curr_buf.get() + curr_pos, PAGE_SIZE);
+		curr_pos += PAGE_SIZE;
 		offset += PAGE_SIZE;
-		pg.extract_to(&pairs, del_mark);
+		loaded_pages++;
+		pairs.clear();
 		pair_idx = 0;
+		if(curr_page.pair_count() != 0 && !curr_page.has_deleted(del_mark)) {
+			page_is_clean = true;
+			return;
+		}
+		dropped_pairs += curr_page.extract_to(&pairs, del_mark);
+	}
+	// load the next page when current one is used up, skipping the pages whose pairs are all deleted
+	void fill() {
+		while(!page_is_clean && pair_idx >= int(pairs.size()) && offset < end_offset) {
+			load_page();
+		}
+	}
+	// decode the clean page before its pairs are used
+	void decode() {
+		while(page_is_clean) {
+			page_is_clean = false;
+			dropped_pairs += curr_page.extract_to(&pairs, del_mark); // some may be deleted since loaded
+			pair_idx = 0;
+			fill();
+		}
 	}
 public:
-	kv_reader(size_t start, size_t end, int fd, bitarray* del_mark):
-	fd(fd), offset(start), end_offset(end), del_mark(del_mark) {
+	kv_reader(size_t start, size_t end, int fd, bitarray* del_mark, rate_limiter* limiter = nullptr):
+	fd(fd), offset(start), end_offset(end), read_offset(start), pair_idx(0), del_mark(del_mark),
+	limiter(limiter), page_is_clean(false), loaded_pages(0), dropped_pairs(0), read_failed(false),
+	curr_size(0), curr_pos(0) {
 		pairs.reserve(100);
-		load_page();
+		if(start < end) {
+			size_t buf_size = std::min(size_t(READ_CHUNK_SIZE), end - start);
+			curr_buf.reset(new char[buf_size]);
+			next_buf.reset(new char[buf_size]);
+			posix_fadvise(fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+			prefetch();
+		}
+		fill();
 	}
+	kv_reader(const kv_reader& other) = delete;
+	kv_reader& operator=(const kv_reader& other) = delete;
+	kv_reader(kv_reader&& other) = delete;
+	kv_reader& operator=(kv_reader&& other) = delete;
+
 	kv_pair peek() {
+		decode();
 		return pairs[pair_idx];
 	}
 	kv_pair produce() {
+		decode();
 		if(!valid()) return kv_pair{};
-		auto kv = peek();
-		if(pair_idx < pairs.size()) {
-			pair_idx++;
-		} else if(offset < end_offset) {
-			load_page();
-		}
+		auto kv = pairs[pair_idx];
+		pair_idx++;
+		fill();
 		return kv;
 	}
 	bool valid() {
-		return offset < end_offset || (offset == end_offset && pair_idx < pairs.size());
+		return page_is_clean || pair_idx < int(pairs.size());
+	}
+	uint64_t peek_key() {
+		return page_is_clean ? curr_page.key_at(0) : pairs[pair_idx].key;
+	}
+	// The next page if none of its pairs has been produced or deleted, otherwise null
+	page* clean_page() {
+		return page_is_clean ? &curr_page : nullptr;
+	}
+	// skip the page returned by 'clean_page', which has been copied by the caller
+	void skip_page() {
+		page_is_clean = false;
+		fill();
+	}
+	uint64_t get_loaded_pages() const {
+		return loaded_pages;
+	}
+	uint64_t get_dropped_pairs() const {
+		return dropped_pairs;
+	}
+	// Whether a read failed. Then it stops early, and the pairs it produced are incomplete.
+	bool failed() const {
+		return read_failed;
+	}
+};
+
+// It appends pages to a vault file with large aligned writes. The space of the expected size can
+// be preallocated to avoid growing the file piece by piece, and the written pages can be flushed
+// to disk in background to avoid a huge burst of dirty pages at the end.
+class vault_writer {
+	enum {
+		WRITE_BUFFER_SIZE = 1024*1024, // must be a multiple of PAGE_SIZE
+		SYNC_RANGE_SIZE = 8*1024*1024, // start writing back after so many bytes are written
+	};
+	int    fd;
+	off_t  offset; // where the bytes in 'buf' will be written
+	char*  buf; // aligned to PAGE_SIZE
+	size_t used;
+	bool   sync_in_background;
+	off_t  started_offset; // the writeback of the bytes before it has been started
+	off_t  waited_offset; // the bytes before it are on disk
+	bool   write_buf() {
+		size_t done = 0;
+		while(done < used) {
+			auto sz = pwrite(fd, buf + done, used - done, offset + done);
+			if(sz <= 0) {
+				std::cerr<<"Failed to write vault file"<<std::endl;
+				return false;
+			}
+			done += sz;
+		}
+		offset += used;
+		used = 0;
+		if(sync_in_background && offset - started_offset >= SYNC_RANGE_SIZE) {
+			sync_file_range(fd, started_offset, offset - started_offset, SYNC_FILE_RANGE_WRITE);
+			// the range started last time has had some time, so waiting for it is usually short
+			if(started_offset > waited_offset) {
+				sync_file_range(fd, waited_offset, started_offset - waited_offset,
+					SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+				waited_offset = started_offset;
+			}
+			started_offset = offset;
+		}
+		return true;
+	}
+public:
+	// Write to the end of 'fd', preallocating 'expected_size' bytes if it is not zero
+	vault_writer(int fd, size_t expected_size, bool sync_in_background): fd(fd), buf(nullptr), used(0),
+	sync_in_background(sync_in_background) {
+		offset = lseek(fd, 0, SEEK_END);
+		started_offset = offset;
+		waited_offset = offset;
+		if(posix_memalign((void**)&buf, PAGE_SIZE, WRITE_BUFFER_SIZE) != 0) {
+			std::cerr<<"Failed to allocate the write buffer of vault file"<<std::endl;
+			buf = nullptr; // then all the appends fail
+		}
+		if(expected_size != 0) { // the file size is not changed, only the space is reserved
+			fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, expected_size);
+		}
+	}
+	~vault_writer() {
+		free(buf);
+	}
+	vault_writer(const vault_writer& other) = delete;
+	vault_writer& operator=(const vault_writer& other) = delete;
+	vault_writer(vault_writer&& other) = delete;
+	vault_writer& operator=(vault_writer&& other) = delete;
+
+	bool append(const char* data, size_t size) {
+		if(buf == nullptr) return false;
+		while(size != 0) {
+			size_t n = std::min(size, WRITE_BUFFER_SIZE - used);
+			memcpy(buf + used, data, n);
+			used += n;
+			data += n;
+			size -= n;
+			if(used == WRITE_BUFFER_SIZE && !write_buf()) {
+				return false;
+			}
+		}
+		return true;
+	}
+	// the size of the file once the buffered bytes are written
+	off_t end_offset() const {
+		return offset + used;
+	}
+	// Write the buffered bytes and make all the written bytes durable
+	bool sync() {
+		if(used != 0 && !write_buf()) {
+			return false;
+		}
+		if(fdatasync(fd) != 0) {
+			std::cerr<<"Failed to sync vault file"<<std::endl;
+			return false;
+		}
+		waited_offset = started_offset = offset;
+		return true;
+	}
+	// Write the buffered bytes and release the preallocated space which is not used
+	bool finish() {
+		if(used != 0 && !write_buf()) {
+			return false;
+		}
+		return ftruncate(fd, offset) == 0;
 	}
 };
 
-// It packs a kv_pair stream into pages and store them to vault file
+// It packs a kv_pair stream into pages and store them to vault file, or append them to a buffer
 // The first keys of these pages are recorded in 'vec'
 class kv_packer {
-	int                  fd;
+	// An upper bound of the size of a v2 page filled with the added pairs, which are added in the
+	// order of keys. It is updated in O(1) except for shortening the prefix, while the exact size
+	// would change with each pair because the widths of the key suffixes and the id deltas grow.
+	// The prefix is kept as a length into the first key string, so probing with more pairs copies
+	// no strings.
+	class page_sizer {
+		size_t      count;
+		uint64_t    first_key;
+		uint64_t    last_key;
+		std::string first_kstr; // the key string of the first pair
+		size_t      prefix_len; // the length of the common prefix of the key strings
+		int64_t     min_id;
+		int64_t     max_id;
+		size_t      entry_bytes; // the strings and the varints of their lengths
+		static size_t entry_size(const kv_pair& kv) {
+			return page::varint_size(kv.value.kstr.size()) + page::varint_size(kv.value.vstr.size()) +
+				kv.value.kstr.size() + kv.value.vstr.size();
+		}
+		// the length of the common prefix of 'kstr' and the first 'len' bytes of 'first'
+		static size_t common_prefix(const std::string& first, size_t len, const std::string& kstr) {
+			size_t n = 0;
+			while(n < len && n < kstr.size() && kstr[n] == first[n]) n++;
+			return n;
+		}
+		static size_t calc_size(size_t count, uint64_t first_key, uint64_t last_key, size_t prefix_len,
+		                        int64_t min_id, int64_t max_id, size_t entry_bytes) {
+			if(count == 0) return PAGE_V2_HEADER_SIZE;
+			uint64_t diff = first_key ^ last_key;
+			size_t key_bytes = diff == 0 ? 0 : (64 - __builtin_clzll(diff) + 7) / 8;
+			size_t id_bytes = page::varint_size(uint64_t(max_id - min_id));
+			return PAGE_V2_HEADER_SIZE + prefix_len + 1/*alignment*/ +
+				count * (key_bytes + 2/*offset*/ + id_bytes) + entry_bytes - count * prefix_len;
+		}
+	public:
+		page_sizer() {
+			reset();
+		}
+		void reset() {
+			count = 0;
+			first_kstr.clear();
+			prefix_len = 0;
+			entry_bytes = 0;
+		}
+		void add(const kv_pair& kv) {
+			if(count == 0) {
+				first_key = kv.key;
+				first_kstr = kv.value.kstr;
+				prefix_len = first_kstr.size();
+				min_id = max_id = kv.id;
+			}
+			prefix_len = common_prefix(first_kstr, prefix_len, kv.value.kstr);
+			count++;
+			last_key = kv.key;
+			min_id = std::min(min_id, kv.id);
+			max_id = std::max(max_id, kv.id);
+			entry_bytes += entry_size(kv);
+		}
+		size_t size() const {
+			return calc_size(count, first_key, last_key, prefix_len, min_id, max_id, entry_bytes);
+		}
+		// the size after the pairs in [begin, end) are added, which are not really added
+		size_t size_with(const kv_pair* begin, const kv_pair* end) const {
+			if(begin == end) return size();
+			const std::string& first = count == 0 ? begin->value.kstr : first_kstr;
+			size_t len = count == 0 ? first.size() : prefix_len;
+			int64_t lo = count == 0 ? begin->id : min_id;
+			int64_t hi = count == 0 ? begin->id : max_id;
+			size_t bytes = entry_bytes;
+			for(auto kv = begin; kv != end; kv++) {
+				len = common_prefix(first, len, kv->value.kstr);
+				lo = std::min(lo, kv->id);
+				hi = std::max(hi, kv->id);
+				bytes += entry_size(*kv);
+			}
+			return calc_size(count + (end - begin), count == 0 ? begin->key : first_key, (end - 1)->key,
+				len, lo, hi, bytes);
+		}
+	};
+	vault_writer*        writer;
+	std::string*         buf;
 	std::vector<kv_pair> kv_list; // a cache for pending kv_pair
-	int                  used_size;
+	page_sizer           sizer;
 	bloomfilter*         bf;
 	u64vec*              vec;
 public:
-	kv_packer(int fd, bloomfilter* bf, u64vec* v):
-		fd(fd), used_size(PAGE_INIT_SIZE), bf(bf), vec(v) {
+	kv_packer(vault_writer* writer, bloomfilter* bf, u64vec* v):
+		writer(writer), buf(nullptr), bf(bf), vec(v) {
+		kv_list.reserve(100);
+	}
+	kv_packer(std::string* buf, bloomfilter* bf, u64vec* v):
+		writer(nullptr), buf(buf), bf(bf), vec(v) {
 		kv_list.reserve(100);
 	}
-	size_t size_of_kv_pair(const kv_pair& kv) {
+	// the size of a pair in a v1 page, which is used as an upper bound of the packed size
+	static size_t size_of_kv_pair(const dual_string& value) {
 		return 2/*offset*/ + 8/*id*/ + 8/*key*/ + 4/*two lengths*/ +
-			kv.value.kstr.size() + kv.value.vstr.size();
+			value.kstr.size() + value.vstr.size();
+	}
+	static size_t size_of_kv_pair(const kv_pair& kv) {
+		return size_of_kv_pair(kv.value);
 	}
-	// consume a kv_pair and store it in cache
+	// consume a kv_pair and store it in cache. 'bf' can be null if the caller fills the bloomfilter.
 	void consume(const kv_pair& kv) {
-		bf->add(kv.key);
-		used_size += size_of_kv_pair(kv);
+		if(bf != nullptr) bf->add(kv.key);
+		sizer.add(kv);
 		kv_list.push_back(kv);
 	}
 	// Returns whether current page can consume 'kv', if not, you must run 'flush' first.
 	bool can_consume(const kv_pair& kv) {
-		return used_size + size_of_kv_pair(kv) < PAGE_SIZE;
+		return sizer.size_with(&kv, &kv + 1) < PAGE_SIZE;
 	}
-	// flush the cache into disk
-	void flush() {
-		if(kv_list.size() == 0) return;
-		vec->append(kv_list[0].key);
+	// Returns whether current page can consume all the kv_pairs in 'list'
+	bool can_consume_all(const std::vector<kv_pair>& list) {
+		return sizer.size_with(list.data(), list.data() + list.size()) < PAGE_SIZE;
+	}
+	// Flush the cache into disk. Returns false if the page cannot be written, and then the cache
+	// is kept.
+	bool flush() {
+		if(kv_list.size() == 0) return true;
 		page pg;
 		pg.fill_with(kv_list);
-		auto sz = write(fd, pg.data(), PAGE_SIZE);
-		assert(sz == PAGE_SIZE);
+		if(buf != nullptr) {
+			buf->append(pg.data(), PAGE_SIZE);
+		} else if(!writer->append(pg.data(), PAGE_SIZE)) {
+			return false;
+		}
+		vec->append(kv_list[0].key);
 		kv_list.clear();
-		used_size = PAGE_INIT_SIZE;
+		sizer.reset();
+		return true;
 	}
 };
 
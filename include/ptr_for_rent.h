@@ -39,6 +39,7 @@ class ptr_for_rent {
 	// Try to delete 'ptr'. If it cannot be deleted now, mark it as "to-be-deleted" and it will be
 	// deleted sometime later.
 	void try_delete(releasable* ptr) {
+		if(ptr == nullptr) return; // nothing was added yet
 		bool ok = ptr->request_to_release();
 		if(ok) delete ptr;
 	}
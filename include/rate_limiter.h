@@ -0,0 +1,109 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+namespace moeingkv {
+
+// A token bucket which caps the bytes per second of background I/O. The callers ask for tokens
+// before each read or write, and sleep when the bucket is in debt. The cap can be changed at
+// runtime. In the auto-tune mode, the cap is lowered when the latency of foreground reads rises
+// above a target, and raised gradually when it is low, staying within [min_rate, max_rate].
+class rate_limiter {
+	enum {
+		BURST_MS = 100, // the bucket holds at most the tokens of so many milliseconds
+		TUNE_INTERVAL_MS = 100, // how often the cap is tuned
+		TUNE_STEPS = 20, // the cap is raised by max_rate/TUNE_STEPS each time
+	};
+	typedef std::chrono::steady_clock clock;
+	std::mutex        mtx; // protects the members except the latency counters
+	int64_t           rate; // bytes per second, 0 for unlimited
+	double            available; // the tokens in the bucket, negative for debt
+	clock::time_point last_refill;
+	bool              auto_tune;
+	int64_t           min_rate;
+	int64_t           max_rate;
+	int64_t           target_latency_us;
+	clock::time_point last_tune;
+	std::atomic_ullong latency_sum_us; // of the foreground reads since last tune
+	std::atomic_ullong latency_count;
+
+	void refill(clock::time_point now) {
+		double secs = std::chrono::duration<double>(now - last_refill).count();
+		last_refill = now;
+		available = std::min(available + secs * rate, double(rate) * BURST_MS / 1000);
+	}
+	// lower the cap if foreground reads are slow, otherwise raise it
+	void tune(clock::time_point now) {
+		if(now - last_tune < std::chrono::milliseconds(TUNE_INTERVAL_MS)) return;
+		last_tune = now;
+		uint64_t sum = latency_sum_us.exchange(0);
+		uint64_t count = latency_count.exchange(0);
+		if(count != 0 && int64_t(sum / count) > target_latency_us) {
+			rate = std::max(min_rate, rate * 3 / 4);
+		} else {
+			rate = std::min(max_rate, rate + std::max(max_rate / TUNE_STEPS, int64_t(1)));
+		}
+	}
+public:
+	rate_limiter(): rate(0), available(0), last_refill(clock::now()), auto_tune(false),
+	min_rate(0), max_rate(0), target_latency_us(0), last_tune(clock::now()),
+	latency_sum_us(0), latency_count(0) {}
+	rate_limiter(const rate_limiter& other) = delete;
+	rate_limiter& operator=(const rate_limiter& other) = delete;
+	rate_limiter(rate_limiter&& other) = delete;
+	rate_limiter& operator=(rate_limiter&& other) = delete;
+
+	// Set a fixed cap of 'bytes_per_sec', 0 for unlimited. It turns off auto-tune.
+	void set_rate(int64_t bytes_per_sec) {
+		std::lock_guard<std::mutex> lk(mtx);
+		auto_tune = false;
+		rate = bytes_per_sec;
+		available = 0;
+		last_refill = clock::now();
+	}
+	// Tune the cap between 'min_bytes_per_sec' and 'max_bytes_per_sec' to keep the average
+	// latency of foreground reads under 'target_us' microseconds
+	void set_auto_tune(int64_t min_bytes_per_sec, int64_t max_bytes_per_sec, int64_t target_us) {
+		std::lock_guard<std::mutex> lk(mtx);
+		auto_tune = true;
+		min_rate = std::max(min_bytes_per_sec, int64_t(1));
+		max_rate = std::max(max_bytes_per_sec, min_rate);
+		target_latency_us = target_us;
+		rate = max_rate;
+		available = 0;
+		last_refill = clock::now();
+		last_tune = last_refill;
+		latency_sum_us.store(0);
+		latency_count.store(0);
+	}
+	int64_t get_rate() {
+		std::lock_guard<std::mutex> lk(mtx);
+		return rate;
+	}
+	// record the latency of a foreground read, which is used by auto-tune
+	void record_latency(int64_t us) {
+		latency_sum_us.fetch_add(us);
+		latency_count.fetch_add(1);
+	}
+	// Take the tokens for 'bytes' bytes of I/O, sleeping if the bucket is in debt
+	void request(size_t bytes) {
+		std::unique_lock<std::mutex> lk(mtx);
+		auto now = clock::now();
+		if(auto_tune) {
+			tune(now);
+		}
+		if(rate == 0) return;
+		refill(now);
+		available -= bytes;
+		if(available >= 0) return;
+		auto wait = std::chrono::duration<double>(-available / rate);
+		lk.unlock();
+		std::this_thread::sleep_for(wait);
+	}
+};
+
+}
@@ -1,35 +1,96 @@
 #pragma once
 #include <mutex>
 #include <atomic>
+#include <array>
+#include <vector>
+#include <algorithm>
 #include "xxhash64.h"
 #include "common.h"
+#include "freq_sketch.h"
+#include "slab.h"
 #include "cpp-btree-1.0.1/btree_map.h"
 
 namespace moeingkv {
 
+enum __cache_stats_t {
+	SPIN_HIST_SIZE = 24, // bucket 0 for no spin, bucket i for [2**(i-1), 2**i) spins
+};
+
+// The counters of one cache shard
+struct cache_shard_stats {
+	uint64_t size;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t evicted_freq_sum; // the sum of the evicted entries' estimated access counts
+	uint64_t admit_count; // new entries admitted by evicting a victim
+	uint64_t reject_count; // new entries rejected by the admission filter
+	// The slab memory of the key and value strings. 1-used_bytes/reserved_bytes is the
+	// fragmentation ratio, and alloc_count/free_count show the allocation rate.
+	uint64_t used_bytes;
+	uint64_t reserved_bytes;
+	uint64_t alloc_count;
+	uint64_t free_count;
+	void accumulate(const cache_shard_stats& other) {
+		size += other.size;
+		hits += other.hits;
+		misses += other.misses;
+		evictions += other.evictions;
+		evicted_freq_sum += other.evicted_freq_sum;
+		admit_count += other.admit_count;
+		reject_count += other.reject_count;
+		used_bytes += other.used_bytes;
+		reserved_bytes += other.reserved_bytes;
+		alloc_count += other.alloc_count;
+		free_count += other.free_count;
+	}
+};
+
+// A snapshot of the statistics of the whole cache
+struct cache_stats {
+	std::vector<cache_shard_stats>        shards;
+	cache_shard_stats                     total;
+	std::array<uint64_t, SPIN_HIST_SIZE>  spin_hist; // histogram of the spin iterations in 'lock'
+};
+
 // A cache with N shards. Each shard has its own mutex and allows one accessor for one time.
 // With N shards, this cache can have many accessors who are accessing different shard.
 // It caches the KV pairs contained in the on-disk and in-mem vaults. Each cache entry has a 
 // timestamp to indicate its age. When a cache shard is full, we try to find an old enough
 // entry to evict.
+// Before evicting an entry for a new one, a TinyLFU admission filter compares their access
+// frequencies, and the new entry is rejected if it is not more popular than the victim. So
+// one-shot scans cannot flush the hot entries out.
 template<int N>
 class sharded_cache {
 	enum {
 		EVICT_TRY_DIST = 10,
 	};
+	// The key and value strings are stored together in one chunk of the shard's slab_alloc
 	struct dstr_id_time {
-		std::string kstr;
-		std::string vstr;
-		int64_t     id;
-		int64_t     timestamp;
+		uint64_t handle;
+		uint32_t klen;
+		uint32_t vlen;
+		int64_t  id;
+		int64_t  timestamp;
 	};
 	typedef btree::btree_multimap<uint64_t, dstr_id_time> i2str_map;
 	struct map {
-		i2str_map  m;
-		std::mutex mtx;
+		i2str_map   m;
+		std::mutex  mtx;
+		freq_sketch sketch;
+		slab_alloc  slab;
+		// The counters are only changed when the mutex is held, so they need no atomic operations
+		// and cause no extra cache-line contention.
+		cache_shard_stats stats;
+		std::array<uint64_t, SPIN_HIST_SIZE> spin_hist;
+		map(): m(), mtx(), sketch(), slab(), stats(), spin_hist() {}
 		void lock() { 
 			//since each access to map would not take a long time, we keep waiting here
-			while(!mtx.try_lock()) {/*do nothing*/}
+			uint64_t spins = 0;
+			while(!mtx.try_lock()) {spins++;}
+			int bucket = spins == 0 ? 0 : 64 - __builtin_clzll(spins);
+			spin_hist[std::min(bucket, int(SPIN_HIST_SIZE-1))]++;
 		}
 		void unlock() {
 			mtx.unlock();
@@ -37,41 +98,89 @@ class sharded_cache {
 		size_t size() {
 			return m.size();
 		}
+		bool key_equal(const dstr_id_time& e, const std::string& kstr) {
+			return e.klen == kstr.size() && memcmp(slab.ptr(e.handle), kstr.data(), e.klen) == 0;
+		}
+		std::string get_kstr(const dstr_id_time& e) {
+			return std::string(slab.ptr(e.handle), e.klen);
+		}
+		// Copy 'kstr' and 'vstr' into e's chunk, which is reused if possible or newly allocated
+		void store(dstr_id_time* e, bool reuse, const std::string& kstr, const std::string& vstr) {
+			size_t size = kstr.size() + vstr.size();
+			if(!reuse || !slab.realloc_in_place(e->handle, e->klen + e->vlen, size)) {
+				if(reuse) slab.free(e->handle, e->klen + e->vlen);
+				e->handle = slab.alloc(size);
+			}
+			e->klen = kstr.size();
+			e->vlen = vstr.size();
+			char* ptr = slab.ptr(e->handle);
+			memcpy(ptr, kstr.data(), kstr.size());
+			memcpy(ptr + kstr.size(), vstr.data(), vstr.size());
+		}
 		// Look up the corresponding 'str_with_id' for 'kstr'. 'key' must be short hash of 'key_str'
 		// Returns whether a valid 'out' is found.
 		bool lookup(uint64_t key, const std::string& kstr, str_with_id* out_ptr) {
 			lock();
+			sketch.increment(key);
 			bool res = false;
 			for(auto iter = m.find(key); iter != m.end(); iter++) {
-				if(iter->second.kstr == kstr) {
-					out_ptr->str = iter->second.vstr;
+				if(key_equal(iter->second, kstr)) {
+					out_ptr->str.assign(slab.ptr(iter->second.handle) + iter->second.klen,
+						iter->second.vlen);
 					out_ptr->id = iter->second.id;
 					res = true;
 					break;
 				}
 			}
+			if(res) {
+				stats.hits++;
+			} else {
+				stats.misses++;
+			}
 			unlock();
 			return res;
 		}
 		// Insert a new entry to the cache or change the cached value, to keep sync with the vaults.
-		void add(uint64_t key, const dstr_id_time& value) {
+		// An existing entry is always changed, unless 'only_if_absent' is true. If the shard has
+		// more than 'max_size' entries, a new entry is inserted only when it is more frequently
+		// accessed than the victim found with 'rand_key', and the victim is evicted.
+		void add(uint64_t key, const std::string& kstr, const std::string& vstr, int64_t id,
+			int64_t timestamp, size_t max_size, uint64_t rand_key, bool admission, bool only_if_absent) {
 			lock();
-			bool found_it = false;
 			for(auto iter = m.find(key); iter != m.end(); iter++) {
-				if(iter->second.kstr == value.kstr) {
-					iter->second = value;
-					found_it = true;
-					break;
+				if(key_equal(iter->second, kstr)) {
+					if(!only_if_absent) {
+						store(&iter->second, true, kstr, vstr);
+						iter->second.id = id;
+						iter->second.timestamp = timestamp;
+					}
+					unlock();
+					return;
 				}
 			}
-			if(!found_it) {
-				m.insert(std::make_pair(key, value));
+			if(size_t(m.size()) > max_size) {
+				auto victim = find_oldest(rand_key);
+				if(victim != m.end()) {
+					int victim_freq = sketch.estimate(victim->first);
+					if(admission && sketch.estimate(key) <= victim_freq) {
+						stats.reject_count++;
+						unlock();
+						return;
+					}
+					stats.admit_count++;
+					stats.evictions++;
+					stats.evicted_freq_sum += victim_freq;
+					slab.free(victim->second.handle, victim->second.klen + victim->second.vlen);
+					m.erase(victim);
+				}
 			}
+			auto value = dstr_id_time{.handle=0, .klen=0, .vlen=0, .id=id, .timestamp=timestamp};
+			store(&value, false, kstr, vstr);
+			m.insert(std::make_pair(key, value));
 			unlock();
 		}
-		// Start iterating from rand_key for EVICT_TRY_DIST steps to find an oldest entry and evict it
-		void evict_oldest(uint64_t rand_key) {
-			lock();
+		// Start iterating from rand_key for EVICT_TRY_DIST steps to find an oldest entry
+		typename i2str_map::iterator find_oldest(uint64_t rand_key) {
 			auto del_pos = m.end(); //pointing to the position for eviction
 			int64_t smallest_time = -1;
 			int dist = 0;
@@ -82,8 +191,43 @@ class sharded_cache {
 					smallest_time = iter->second.timestamp;
 				}
 			}
-			if(del_pos != m.end()) {
-				m.erase(del_pos);
+			return del_pos;
+		}
+		// Remove the entries which record that their keys are not found
+		void drop_negative() {
+			lock();
+			uint64_t key = 0; // the entries before it are not negative
+			for(bool erased = true; erased;) {
+				erased = false;
+				// a new iterator after each erasure, since the copy assignment of btree iterators is deprecated
+				for(auto iter = m.lower_bound(key); iter != m.end(); iter++) {
+					if(iter->second.id < 0) {
+						key = iter->first;
+						slab.free(iter->second.handle, iter->second.klen + iter->second.vlen);
+						m.erase(iter);
+						erased = true;
+						break;
+					}
+				}
+			}
+			unlock();
+		}
+		// Append at most 'count' of the most frequently accessed entries' keys to 'out'
+		void get_hot_keys(size_t count, std::vector<std::pair<uint64_t, std::string>>* out) {
+			std::vector<std::pair<int, typename i2str_map::iterator>> vec;
+			lock();
+			vec.reserve(m.size());
+			for(auto iter = m.begin(); iter != m.end(); iter++) {
+				vec.push_back(std::make_pair(sketch.estimate(iter->first), iter));
+			}
+			count = std::min(count, vec.size());
+			std::partial_sort(vec.begin(), vec.begin()+count, vec.end(),
+				[](const std::pair<int, typename i2str_map::iterator>& a,
+				   const std::pair<int, typename i2str_map::iterator>& b) {
+				return a.first > b.first;
+			});
+			for(size_t i=0; i<count; i++) {
+				out->push_back(std::make_pair(vec[i].second->first, get_kstr(vec[i].second->second)));
 			}
 			unlock();
 		}
@@ -93,27 +237,98 @@ public:
 	int64_t            timestamp;
 	std::atomic_ullong rand_key;
 	size_t             shard_max_size;
+	bool               admission_enabled;
+
+	sharded_cache(): timestamp(0), rand_key(0), shard_max_size(0), admission_enabled(true) {}
 
 	void set_timestamp(int64_t t) {
 		timestamp = t;
 	}
 	void set_shard_max_size(size_t sz) {
 		shard_max_size = sz;
+		for(int i=0; i<N; i++) {
+			map_arr[i].lock();
+			map_arr[i].sketch.resize(sz);
+			map_arr[i].unlock();
+		}
+	}
+	// When disabled, new entries always evict the victims, as a plain sampled-LRU cache.
+	void set_admission_enabled(bool enabled) {
+		admission_enabled = enabled;
+	}
+	// Sum up the admission counters of all the shards
+	void get_admission_counts(uint64_t* admitted, uint64_t* rejected) {
+		cache_stats s;
+		get_stats(&s);
+		*admitted = s.total.admit_count;
+		*rejected = s.total.reject_count;
+	}
+	// Take a snapshot of the counters of every shard and their sum
+	void get_stats(cache_stats* out) {
+		out->shards.resize(N);
+		out->total = cache_shard_stats{};
+		out->spin_hist.fill(0);
+		for(int i=0; i<N; i++) {
+			map_arr[i].lock();
+			out->shards[i] = map_arr[i].stats;
+			out->shards[i].size = map_arr[i].m.size();
+			out->shards[i].used_bytes = map_arr[i].slab.get_used_bytes();
+			out->shards[i].reserved_bytes = map_arr[i].slab.get_reserved_bytes();
+			out->shards[i].alloc_count = map_arr[i].slab.get_alloc_count();
+			out->shards[i].free_count = map_arr[i].slab.get_free_count();
+			for(int j=0; j<SPIN_HIST_SIZE; j++) {
+				out->spin_hist[j] += map_arr[i].spin_hist[j];
+			}
+			map_arr[i].unlock();
+			out->total.accumulate(out->shards[i]);
+		}
+	}
+	void reset_stats() {
+		for(int i=0; i<N; i++) {
+			map_arr[i].lock();
+			map_arr[i].stats = cache_shard_stats{};
+			map_arr[i].spin_hist.fill(0);
+			map_arr[i].unlock();
+		}
 	}
 	// lookup a cache entry. 'key' must be short hash of 'key_str'
 	bool lookup(uint64_t key, const std::string& key_str, str_with_id* out_ptr) {
 		rand_key.fetch_xor(key);
 		return map_arr[key%N].lookup(key, key_str, out_ptr);
 	}
-	// Add a new cache entry and if the shard is full, evict the oldest
+	// Add a new cache entry and if the shard is full, evict the oldest unless the admission
+	// filter rejects the new entry
 	void add(uint64_t key, const std::string& kstr, const std::string& vstr, int64_t id) {
-		auto value = dstr_id_time{.kstr=kstr, .vstr=vstr, .id=id, .timestamp=timestamp};
 		auto idx = key%N;
 		if(map_arr[idx].size() > shard_max_size) {
 			rand_key.store(hash(rand_key.load(), key));
-			map_arr[idx].evict_oldest(rand_key.load());
 		}
-		map_arr[idx].add(key, value);
+		map_arr[idx].add(key, kstr, vstr, id, timestamp, shard_max_size, rand_key.load(),
+			admission_enabled, false);
+	}
+	// Similar to 'add', but an existing entry is not changed. It is used to pre-load the cache
+	// in background, where 'vstr' may be older than the cached value.
+	void add_if_absent(uint64_t key, const std::string& kstr, const std::string& vstr, int64_t id) {
+		auto idx = key%N;
+		if(map_arr[idx].size() > shard_max_size) {
+			rand_key.store(hash(rand_key.load(), key));
+		}
+		map_arr[idx].add(key, kstr, vstr, id, timestamp, shard_max_size, rand_key.load(),
+			admission_enabled, true);
+	}
+	// Forget the keys which were not found, after they are added to the vaults bypassing cache.
+	// Each shard is locked during its whole walk, so it can run with lookups and additions.
+	void drop_negative() {
+		for(int i=0; i<N; i++) {
+			map_arr[i].drop_negative();
+		}
+	}
+	// Get the keys of about 'count' hottest entries, taking count/N entries from each shard
+	void get_hot_keys(size_t count, std::vector<std::pair<uint64_t, std::string>>* out) {
+		out->clear();
+		for(int i=0; i<N; i++) {
+			map_arr[i].get_hot_keys((count+N-1)/N, out);
+		}
 	}
 };
 
@@ -0,0 +1,139 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+
+namespace moeingkv {
+
+// A slab allocator which serves byte chunks from size-classed slabs. The chunks are referred to
+// with compact 64-bit handles instead of pointers. A freed chunk is kept in its class's free list
+// and reused, so in steady state there are no calls to malloc or free.
+// The size classes are 16, 24, 32, 48, 64, ... , 3072, 4096 bytes. Larger chunks are allocated
+// one by one from heap.
+// It is not thread-safe, the caller must serialize the accesses.
+class slab_alloc {
+	enum {
+		MIN_CLASS_BITS = 4, // the smallest class is 16 bytes
+		CLASS_COUNT = 17, // the largest class is 4096 bytes
+		LARGE_CLASS = CLASS_COUNT,
+		SLAB_SIZE = 64*1024,
+		CLASS_SHIFT = 56,
+	};
+	struct size_class {
+		std::vector<std::unique_ptr<char[]>> slabs;
+		std::vector<uint64_t> free_slots;
+		uint64_t next_slot; // the slots after it have never been used
+	};
+	size_class classes[CLASS_COUNT];
+	std::vector<std::unique_ptr<char[]>> large_chunks;
+	std::vector<uint64_t> free_large;
+	uint64_t used_bytes; // the bytes requested by the living chunks
+	uint64_t reserved_bytes; // the bytes allocated from heap
+	uint64_t alloc_count;
+	uint64_t free_count;
+
+	static int class_of(size_t size) {
+		if(size <= (1<<MIN_CLASS_BITS)) return 0;
+		int b = 63 - __builtin_clzll(size-1); // 2**b < size <= 2**(b+1)
+		size_t half = (size_t(3) << b) / 2;
+		return (b-MIN_CLASS_BITS)*2 + (size > half ? 2 : 1);
+	}
+	static size_t class_size(int c) {
+		size_t base = size_t(1) << (MIN_CLASS_BITS + c/2);
+		return c%2 == 0 ? base : base*3/2;
+	}
+	static size_t slots_per_slab(int c) {
+		return SLAB_SIZE / class_size(c);
+	}
+public:
+	slab_alloc(): used_bytes(0), reserved_bytes(0), alloc_count(0), free_count(0) {
+		for(int c=0; c<CLASS_COUNT; c++) {
+			classes[c].next_slot = 0;
+		}
+	}
+	slab_alloc(const slab_alloc& other) = delete;
+	slab_alloc& operator=(const slab_alloc& other) = delete;
+	slab_alloc(slab_alloc&& other) = delete;
+	slab_alloc& operator=(slab_alloc&& other) = delete;
+
+	// Try to reuse the chunk referred by 'handle' for 'new_size' bytes, which is possible when
+	// 'new_size' falls in the same size class of 'old_size'. Returns whether it succeeds.
+	bool realloc_in_place(uint64_t handle, size_t old_size, size_t new_size) {
+		int c = int(handle >> CLASS_SHIFT);
+		if(c == LARGE_CLASS ? old_size != new_size : class_of(new_size) != c) {
+			return false;
+		}
+		used_bytes = used_bytes + new_size - old_size;
+		return true;
+	}
+	// Allocate a chunk of 'size' bytes and return its handle.
+	uint64_t alloc(size_t size) {
+		alloc_count++;
+		used_bytes += size;
+		int c = class_of(size);
+		if(c >= CLASS_COUNT) {
+			reserved_bytes += size;
+			uint64_t idx;
+			if(free_large.empty()) {
+				idx = large_chunks.size();
+				large_chunks.emplace_back();
+			} else {
+				idx = free_large.back();
+				free_large.pop_back();
+			}
+			large_chunks[idx].reset(new char[size]);
+			return (uint64_t(LARGE_CLASS) << CLASS_SHIFT) | idx;
+		}
+		auto& sc = classes[c];
+		uint64_t slot;
+		if(!sc.free_slots.empty()) {
+			slot = sc.free_slots.back();
+			sc.free_slots.pop_back();
+		} else {
+			slot = sc.next_slot++;
+			if(slot / slots_per_slab(c) >= sc.slabs.size()) {
+				sc.slabs.emplace_back(new char[SLAB_SIZE]);
+				reserved_bytes += SLAB_SIZE;
+			}
+		}
+		return (uint64_t(c) << CLASS_SHIFT) | slot;
+	}
+	// Free the chunk referred by 'handle', whose size is 'size'
+	void free(uint64_t handle, size_t size) {
+		free_count++;
+		used_bytes -= size;
+		int c = int(handle >> CLASS_SHIFT);
+		uint64_t slot = handle & ((uint64_t(1) << CLASS_SHIFT) - 1);
+		if(c == LARGE_CLASS) {
+			reserved_bytes -= size;
+			large_chunks[slot].reset();
+			free_large.push_back(slot);
+			return;
+		}
+		classes[c].free_slots.push_back(slot);
+	}
+	char* ptr(uint64_t handle) const {
+		int c = int(handle >> CLASS_SHIFT);
+		uint64_t slot = handle & ((uint64_t(1) << CLASS_SHIFT) - 1);
+		if(c == LARGE_CLASS) {
+			return large_chunks[slot].get();
+		}
+		auto per_slab = slots_per_slab(c);
+		return classes[c].slabs[slot/per_slab].get() + (slot%per_slab)*class_size(c);
+	}
+	uint64_t get_used_bytes() const {
+		return used_bytes;
+	}
+	uint64_t get_reserved_bytes() const {
+		return reserved_bytes;
+	}
+	uint64_t get_alloc_count() const {
+		return alloc_count;
+	}
+	uint64_t get_free_count() const {
+		return free_count;
+	}
+};
+
+}
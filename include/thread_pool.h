@@ -0,0 +1,94 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+namespace moeingkv {
+
+// A fixed group of worker threads which run the tasks of 'parallel_for'. The caller of
+// 'parallel_for' also runs tasks, and it returns after all the tasks are finished.
+// Only one 'parallel_for' runs at a time, concurrent callers are serialized.
+class thread_pool {
+	std::vector<std::thread> workers;
+	std::mutex               run_mtx; // serializes the callers of 'parallel_for'
+	std::mutex               mtx;
+	std::condition_variable  cv; // notifies the workers of a new job
+	std::condition_variable  done_cv; // notifies the caller that all the workers are idle
+	std::function<void(int)> job;
+	int                      job_size;
+	std::atomic_int          next_task;
+	int                      busy_workers;
+	uint64_t                 generation; // increased for each job
+	bool                     stop;
+
+	void run_tasks() {
+		for(;;) {
+			int i = next_task.fetch_add(1);
+			if(i >= job_size) break;
+			job(i);
+		}
+	}
+	void work() {
+		uint64_t seen = 0;
+		std::unique_lock<std::mutex> lk(mtx);
+		for(;;) {
+			cv.wait(lk, [this, seen]() {return this->stop || this->generation != seen;});
+			if(stop) return;
+			seen = generation;
+			lk.unlock();
+			run_tasks();
+			lk.lock();
+			if(--busy_workers == 0) {
+				done_cv.notify_all();
+			}
+		}
+	}
+public:
+	thread_pool(int n): job_size(0), next_task(0), busy_workers(0), generation(0), stop(false) {
+		for(int i=0; i<n; i++) {
+			workers.emplace_back([this]() {this->work();});
+		}
+	}
+	~thread_pool() {
+		std::unique_lock<std::mutex> lk(mtx);
+		stop = true;
+		lk.unlock();
+		cv.notify_all();
+		for(auto& t : workers) {
+			t.join();
+		}
+	}
+	thread_pool(const thread_pool& other) = delete;
+	thread_pool& operator=(const thread_pool& other) = delete;
+	thread_pool(thread_pool&& other) = delete;
+	thread_pool& operator=(thread_pool&& other) = delete;
+
+	int size() {
+		return workers.size();
+	}
+	// Run f(0), f(1), ... , f(n-1) in parallel and wait for all of them to finish
+	void parallel_for(int n, std::function<void(int)> f) {
+		if(workers.size() == 0 || n <= 1) {
+			for(int i=0; i<n; i++) f(i);
+			return;
+		}
+		std::lock_guard<std::mutex> run_lk(run_mtx);
+		std::unique_lock<std::mutex> lk(mtx);
+		job = std::move(f);
+		job_size = n;
+		next_task.store(0);
+		busy_workers = workers.size();
+		generation++;
+		lk.unlock();
+		cv.notify_all();
+		run_tasks();
+		lk.lock();
+		done_cv.wait(lk, [this]() {return this->busy_workers == 0;});
+		job = nullptr;
+	}
+};
+
+}
@@ -91,8 +91,9 @@ public:
 		}
 		return binary_search(value, start, end-start);
 	}
+	// find the last position p in [low, low+size) such that get(p) <= value, given get(low) <= value
 	ssize_t binary_search(uint64_t value, ssize_t low, ssize_t size) {
-		while (size > 0) {
+		while (size > 1) {
 			ssize_t half = size / 2; //half*2==size || half*2+1==size
 			ssize_t probe = low + half;
 			auto v = get(probe);
@@ -1,5 +1,6 @@
 #pragma once
 #include "page.h"
+#include "thread_pool.h"
 
 namespace moeingkv {
 
@@ -12,10 +13,71 @@ namespace moeingkv {
 class vault_in_mem: public ds_with_log {
 private:
 	typedef btree::btree_multimap<uint64_t, dstr_with_id> i2str_map;
+	typedef std::vector<std::pair<uint64_t, dstr_with_id>> entry_list;
 	i2str_map m[ROW_COUNT];
+	size_t bytes_at_row[ROW_COUNT]; // the bytes of the pairs in each row, once packed into pages
+	int64_t min_id_at_row[ROW_COUNT]; // the smallest id in each row, INT64_MAX for an empty row
+	int64_t last_logged_id; // the id of the previous entry in the current frame
 
+	static uint64_t zigzag(int64_t i) {
+		return (uint64_t(i) << 1) ^ uint64_t(i >> 63);
+	}
+	static int64_t unzigzag(uint64_t u) {
+		return int64_t(u >> 1) ^ -int64_t(u & 1);
+	}
+	// Decode the entries in a frame of LOG_ENCODING_COMPACT and append them to 'rows'
+	static bool decode_compact_frame(const log_frame& frame, entry_list* rows) {
+		log_reader reader(frame.data, frame.size);
+		int64_t id = 0;
+		while(!reader.at_end()) {
+			uint64_t key, delta, klen, vlen;
+			dstr_with_id value;
+			bool ok = reader.read_u64(&key) && reader.read_varint(&delta) &&
+				reader.read_varint(&klen) && reader.read_varint(&vlen) &&
+				reader.read_str_of_size(&value.dstr.kstr, klen) &&
+				reader.read_str_of_size(&value.dstr.vstr, vlen);
+			if(!ok) return false;
+			id += unzigzag(delta);
+			value.id = id;
+			rows[row_from_key(key)].emplace_back(key, std::move(value));
+		}
+		return true;
+	}
+	// Decode the entries in a frame of LOG_ENCODING_RAW and append them to 'rows'
+	static bool decode_raw_frame(const log_frame& frame, entry_list* rows) {
+		log_reader reader(frame.data, frame.size);
+		while(!reader.at_end()) {
+			uint64_t key;
+			dstr_with_id value;
+			bool ok = reader.read_u64(&key) && reader.read_i64(&value.id) &&
+				reader.read_str(&value.dstr.kstr) && reader.read_str(&value.dstr.vstr);
+			if(!ok) return false;
+			rows[row_from_key(key)].emplace_back(key, std::move(value));
+		}
+		return true;
+	}
+	// a raw entry is a key, an id and two u32-prefixed strings
+	size_t raw_entries_size(const char* data, size_t size) {
+		log_reader reader(data, size);
+		size_t whole = 0;
+		for(;;) {
+			uint64_t key;
+			int64_t id;
+			std::string kstr, vstr;
+			if(!reader.read_u64(&key) || !reader.read_i64(&id) ||
+			   !reader.read_str(&kstr) || !reader.read_str(&vstr)) {
+				return whole;
+			}
+			whole = size - reader.left();
+		}
+	}
 public:
-	vault_in_mem(): m() {}
+	vault_in_mem(): m(), bytes_at_row(), last_logged_id(0) {
+		log_encoding = LOG_ENCODING_COMPACT;
+		for(int row=0; row<ROW_COUNT; row++) {
+			min_id_at_row[row] = INT64_MAX;
+		}
+	}
 	vault_in_mem(const vault_in_mem& other) = delete;
 	vault_in_mem& operator=(const vault_in_mem& other) = delete;
 	vault_in_mem(vault_in_mem&& other) = delete;
@@ -24,6 +86,29 @@ public:
 	size_t size_at_row(int row) {
 		return m[row].size();
 	}
+	size_t size() {
+		size_t total = 0;
+		for(int row=0; row<ROW_COUNT; row++) {
+			total += m[row].size();
+		}
+		return total;
+	}
+	// the estimated bytes of all the pairs once packed into pages
+	size_t packed_bytes() {
+		size_t total = 0;
+		for(int row=0; row<ROW_COUNT; row++) {
+			total += bytes_at_row[row];
+		}
+		return total;
+	}
+	// the smallest id of the pairs, including the deleted ones, INT64_MAX if it is empty
+	int64_t min_id() {
+		int64_t res = INT64_MAX;
+		for(int row=0; row<ROW_COUNT; row++) {
+			res = std::min(res, min_id_at_row[row]);
+		}
+		return res;
+	}
 	// Look up the corresponding 'str_with_id' for 'key_str'. 'key' must be short hash of 'key_str'
 	// and its id must have not been marked as deleted in 'del_mark'. 
 	// Returns whether a valid 'out' is found.
@@ -38,37 +123,106 @@ public:
 		}
 		return false;
 	}
-	// write a log entry of adding kv
+	// Write a log entry of adding kv. The key is kept as fixed 8 bytes because it is a hash value,
+	// the id is coded as a zigzag varint of its delta to the previous entry in the same frame,
+	// which is usually 1, and the lengths of the strings are varints.
 	void log_add_kv(uint64_t key, const dstr_with_id& value) {
+		if(frame_is_empty()) {
+			last_logged_id = 0;
+		}
 		log_u64(key);
-		log_i64(value.id);
-		log_str(value.dstr.kstr);
-		log_str(value.dstr.vstr);
+		log_varint(zigzag(value.id - last_logged_id));
+		last_logged_id = value.id;
+		log_varint(value.dstr.kstr.size());
+		log_varint(value.dstr.vstr.size());
+		log_bytes(value.dstr.kstr.data(), value.dstr.kstr.size());
+		log_bytes(value.dstr.vstr.data(), value.dstr.vstr.size());
 	}
 	// add new kv pair
 	void add(uint64_t key, const dstr_with_id& value) {
 		auto row = row_from_key(key);
 		m[row].insert(std::make_pair(key, value));
+		bytes_at_row[row] += kv_packer::size_of_kv_pair(value.dstr);
+		min_id_at_row[row] = std::min(min_id_at_row[row], value.id);
 	}
-	bool load_data_from_log(const std::string& fname) {
-		std::ifstream fin;
-		fin.open(fname.c_str(), std::ios::in | std::ios::binary);
-		if(!fin.is_open()) {
-			std::cerr<<"Failed to open file "<<fname<<std::endl;
+	// Replay the log file 'fname', which may contain frames of all the encodings.
+	// A torn frame at its end is cut off. The file is mapped into memory, and its frames are
+	// divided into contiguous ranges which are decoded in parallel by 'workers', with the
+	// entries split by row. Then the rows are rebuilt in parallel, and in each row the entries
+	// are inserted in the order of the log. 'workers' can be null for serial replay. It is meant
+	// for the recovery on open, which replays the logs before any write and can pass the write
+	// path's 'workers'. No such recovery path exists yet, so nothing calls it for now.
+	bool load_data_from_log(const std::string& fname, thread_pool* workers = nullptr) {
+		mapped_file content;
+		std::vector<log_frame> frames;
+		if(!read_log_frames(fname, &content, &frames, true)) {
 			return false;
 		}
-		while((fin.rdstate() & std::ios::eofbit) != 0) {
-			uint64_t key;
-			read_u64(fin, &key);
-			dstr_with_id value;
-			read_i64(fin, &value.id);
-			read_str(fin, &value.dstr.kstr);
-			read_str(fin, &value.dstr.vstr);
-			add(key, value);
-			if((fin.rdstate() & std::ios::failbit ) != 0) {
-				std::cerr<<"Error when reading "<<fname<<std::endl;
-				return false;
+		int task_count = workers == nullptr ? 1 : workers->size() + 1;
+		if(task_count > int(frames.size())) {
+			task_count = std::max(int(frames.size()), 1);
+		}
+		// split the frames into ranges with about the same number of bytes
+		std::vector<size_t> range_start(task_count+1, frames.size());
+		size_t total_bytes = 0;
+		for(auto& frame : frames) total_bytes += frame.size;
+		size_t acc_bytes = 0;
+		for(size_t i = 0, t = 0; i < frames.size() && t < size_t(task_count); i++) {
+			if(acc_bytes >= total_bytes * t / task_count) {
+				range_start[t++] = i;
+			}
+			acc_bytes += frames[i].size;
+		}
+		std::vector<entry_list> task_rows(task_count * ROW_COUNT);
+		std::atomic_bool ok(true);
+		auto decode = [&frames, &range_start, &task_rows, &ok](int t) {
+			entry_list* rows = &task_rows[t * ROW_COUNT];
+			for(size_t i = range_start[t]; i < range_start[t+1]; i++) {
+				bool frame_ok = false;
+				if(frames[i].encoding == LOG_ENCODING_COMPACT) {
+					frame_ok = decode_compact_frame(frames[i], rows);
+				} else if(frames[i].encoding == LOG_ENCODING_RAW) {
+					frame_ok = decode_raw_frame(frames[i], rows);
+				}
+				if(!frame_ok) {
+					ok.store(false);
+					return;
+				}
 			}
+		};
+		auto rebuild = [this, task_count, &task_rows](int row) {
+			entry_list entries;
+			for(int t = 0; t < task_count; t++) {
+				auto& list = task_rows[t * ROW_COUNT + row];
+				entries.insert(entries.end(), std::make_move_iterator(list.begin()),
+					std::make_move_iterator(list.end()));
+				entry_list().swap(list);
+			}
+			// sorted input can be appended at the end of btree, the stable sort keeps the log
+			// order of the entries with the same key
+			std::stable_sort(entries.begin(), entries.end(),
+				[](const std::pair<uint64_t, dstr_with_id>& a, const std::pair<uint64_t, dstr_with_id>& b) {
+					return a.first < b.first;
+				});
+			for(auto& e : entries) {
+				this->m[row].insert(this->m[row].end(), e);
+				this->bytes_at_row[row] += kv_packer::size_of_kv_pair(e.second.dstr);
+				this->min_id_at_row[row] = std::min(this->min_id_at_row[row], e.second.id);
+			}
+		};
+		if(workers == nullptr) {
+			decode(0);
+		} else {
+			workers->parallel_for(task_count, decode);
+		}
+		if(!ok.load()) {
+			std::cerr<<"Error when reading "<<fname<<std::endl;
+			return false;
+		}
+		if(workers == nullptr) {
+			for(int row = 0; row < ROW_COUNT; row++) rebuild(row);
+		} else {
+			workers->parallel_for(ROW_COUNT, rebuild);
 		}
 		return true;
 	}
@@ -76,6 +230,7 @@ public:
 		i2str_map* m;
 		i2str_map::iterator iter;
 		bitarray* del_mark;
+		uint64_t dropped_pairs; // the deleted pairs skipped
 		friend class vault_in_mem;
 	public:
 		kv_pair peek() {
@@ -85,12 +240,23 @@ public:
 				.value=iter->second.dstr
 			};
 		}
+		uint64_t peek_key() {
+			return iter->first;
+		}
 		kv_pair produce() {
 			auto res = peek();
+			iter++;
+			skip_deleted();
+			return res;
+		}
+		void skip_deleted() {
 			for(; iter != m->end(); iter++) {
 				if(!del_mark->get(iter->second.id)) break;
+				dropped_pairs++;
 			}
-			return res;
+		}
+		uint64_t get_dropped_pairs() const {
+			return dropped_pairs;
 		}
 		bool valid() {
 			return iter != m->end();
@@ -101,6 +267,8 @@ public:
 		res.m=&m[row];
 		res.iter=m[row].begin();
 		res.del_mark=del_mark;
+		res.dropped_pairs=0;
+		res.skip_deleted();
 		return res;
 	}
 };
@@ -0,0 +1,99 @@
+// After a restart, the disk vaults written by an earlier process must not let del_mark prune
+// the ids of their kv pairs.
+// g++ -std=c++17 -fpermissive -I../include vault_min_id.cpp -lpthread
+#include <cassert>
+#include <algorithm>
+#include <iostream>
+#include "internalkv.h"
+
+namespace moeingkv {
+
+class internalkv_tester {
+public:
+	// a store with the disk vaults 0 and 1 under 'dir', like one which has just been opened
+	static void init(internalkv* kv, const std::string& dir, int64_t next_id) {
+		kv->data_dir = dir;
+		kv->oldest_vault = 0;
+		kv->youngest_vault = 1;
+		kv->next_id = next_id;
+		kv->rw_vault->set_log_dir(dir+"/"+MEM_VAULT_LOG_DIR);
+		kv->rw_vault->open_log(3);
+		kv->ro_vault->set_log_dir(dir+"/"+MEM_VAULT_LOG_DIR);
+		kv->ro_vault->open_log(2);
+		kv->del_mark.set_log_dir(dir+"/"+DEL_LOG_DIR);
+		kv->del_mark.open_log(2);
+		for(int num = kv->oldest_vault; num <= kv->youngest_vault; num++) {
+			auto fname = dir+"/"+DISK_VAULT_DIR+"/"+std::to_string(num);
+			kv->vault_fd[num%VAULT_COUNT] = open(fname.c_str(), O_RDWR | O_CREAT, 0644);
+		}
+	}
+	static int64_t next_id(internalkv* kv) {
+		return kv->next_id;
+	}
+	static int64_t min_live_id(internalkv* kv) {
+		return kv->min_live_id();
+	}
+	static bool prune_and_get(internalkv* kv, int64_t pos, int64_t id) {
+		kv->del_mark.prune_till(pos);
+		return kv->del_mark.get(id);
+	}
+};
+
+}
+
+using namespace moeingkv;
+
+struct vec_producer : public kv_producer {
+	std::vector<kv_pair> pairs;
+	size_t pos = 0;
+	kv_pair peek() { return pairs[pos]; }
+	kv_pair produce() { return pairs[pos++]; }
+	bool valid() { return pos < pairs.size(); }
+};
+
+int main() {
+	std::string dir = "/tmp/moeingkv_vault_min_id";
+	system(("rm -rf "+dir).c_str());
+	for(auto sub : {MEM_VAULT_LOG_DIR, DISK_VAULT_DIR, DEL_LOG_DIR, CHECKPOINT_DIR}) {
+		system(("mkdir -p "+dir+"/"+sub).c_str());
+	}
+	seeds s;
+	for(int i=0; i<HASH_COUNT; i++) s.u64[i] = i*7+1;
+
+	// the first process ingests some pairs into disk vault 1
+	auto first = new internalkv(64, s);
+	internalkv_tester::init(first, dir, VALID_ID_START);
+	vec_producer prod;
+	for(int i=0; i<1000; i++) {
+		kv_pair kv;
+		kv.value.kstr = "k"+std::to_string(i);
+		kv.value.vstr = "v"+std::to_string(i);
+		kv.key = hash(i, 5);
+		prod.pairs.push_back(kv);
+	}
+	std::sort(prod.pairs.begin(), prod.pairs.end(), [](const kv_pair& a, const kv_pair& b) {
+		return a.key < b.key;
+	});
+	if(first->ingest(&prod) != 1000) {
+		std::cerr<<"Failed to ingest"<<std::endl;
+		return 1;
+	}
+	int64_t next_id = internalkv_tester::next_id(first);
+	delete first;
+
+	// the second process opens the same vaults, whose ids it does not know yet
+	auto second = new internalkv(64, s);
+	internalkv_tester::init(second, dir, next_id);
+	int64_t min_id = internalkv_tester::min_live_id(second);
+	if(min_id > VALID_ID_START) {
+		std::cerr<<"min_live_id "<<min_id<<" is above the ids in vault 1"<<std::endl;
+		return 1;
+	}
+	if(internalkv_tester::prune_and_get(second, min_id, VALID_ID_START)) {
+		std::cerr<<"A live id looks deleted after pruning"<<std::endl;
+		return 1;
+	}
+	delete second;
+	std::cout<<"OK"<<std::endl;
+	return 0;
+}
@@ -0,0 +1,68 @@
+// 'wait_durable' must return at once for a sequence number which is not given to any batch yet,
+// instead of waiting for writes which may never come.
+// g++ -std=c++17 -fpermissive -I../include wait_durable.cpp -lpthread
+#include <cassert>
+#include <future>
+#include <iostream>
+#include "internalkv.h"
+
+namespace moeingkv {
+
+class internalkv_tester {
+public:
+	// a store with only the logs of rw_vault and del_mark under 'dir'
+	static void init(internalkv* kv, const std::string& dir) {
+		kv->data_dir = dir;
+		kv->oldest_vault = 0;
+		kv->youngest_vault = 255;
+		kv->next_id = VALID_ID_START;
+		kv->rw_vault->set_log_dir(dir+"/"+MEM_VAULT_LOG_DIR);
+		kv->rw_vault->open_log(1);
+		kv->del_mark.set_log_dir(dir+"/"+DEL_LOG_DIR);
+		kv->del_mark.open_log(2);
+	}
+};
+
+}
+
+using namespace moeingkv;
+
+int main() {
+	std::string dir = "/tmp/moeingkv_wait_durable";
+	system(("rm -rf "+dir).c_str());
+	for(auto sub : {MEM_VAULT_LOG_DIR, DEL_LOG_DIR}) {
+		system(("mkdir -p "+dir+"/"+sub).c_str());
+	}
+	seeds s;
+	auto kv = new internalkv(1024, s);
+	internalkv_tester::init(kv, dir);
+	kv->set_durability(SYNC_BY_WINDOW, 1000, 1<<30); // nothing is synced by the window itself
+
+	batch_map batch;
+	dstr_with_id v;
+	v.dstr.kstr = "key";
+	v.dstr.vstr = "value";
+	v.id = 1;
+	batch.insert(std::make_pair(hash(1, 5), v));
+	int64_t seq = kv->update(&batch);
+	if(!kv->wait_durable(seq)) {
+		std::cerr<<"A written batch is not durable"<<std::endl;
+		return 1;
+	}
+	for(int64_t future_seq : {seq + 1, seq + 100}) {
+		auto res = std::async(std::launch::async, [kv, future_seq]() {
+			return kv->wait_durable(future_seq);
+		});
+		if(res.wait_for(std::chrono::seconds(5)) != std::future_status::ready) {
+			std::cerr<<"wait_durable hangs for the unused sequence number "<<future_seq<<std::endl;
+			_exit(1); // the waiting thread cannot be joined
+		}
+		if(res.get()) {
+			std::cerr<<"The unused sequence number "<<future_seq<<" is reported durable"<<std::endl;
+			return 1;
+		}
+	}
+	delete kv;
+	std::cout<<"OK"<<std::endl;
+	return 0;
+}